@@ -0,0 +1,232 @@
+# BenchMatching.py
+# Benchmark of query latency on dense material: a catalog of songs stitched
+# together from pieces of the same few recordings, so most hashes are shared
+# by many songs, like popular material sampled and remixed across a catalog.
+# Snippets of the stitched songs are matched against a sqlite database and a
+# segment index, tallying every song and with top-k matching, and the mean,
+# 95th percentile and worst query times are reported. Then the same snippets
+# are matched against sharded indexes of the catalog with more and more
+# shards, to show how latency scales with the cores the shard workers get.
+#
+# With --check, nothing is timed. Instead topMatches is checked against the
+# full tally on every snippet, and on snippets mixing two songs, for a few
+# values of k, margin and minimum matches: the songs it returns must be a
+# top k of the full tally, with counts no higher than the full ones.
+import argparse
+import os
+import random
+import sqlite3
+import sys
+import tempfile
+import time
+
+import BenchPostings
+import PrintMatcher
+import SegmentIndex
+import ShardedIndex
+
+DBINIT = 'InitDatabase.sql'
+
+def stitchSongs(baseRows, songs, windows, chunk, rng):
+    """Make songs of about windows time windows each out of chunk window
+    pieces of the base songs' (songId, hash, offset) rows. Returns the
+    (songId, hash, offset) rows of the new songs, ids starting at 1."""
+    bySong = {}
+    for songId, hashVal, offset in baseRows:
+        bySong.setdefault(songId, []).append((offset, hashVal))
+    bases = [sorted(rows) for rows in bySong.values()]
+
+    rows = []
+    for songId in range(1, songs + 1):
+        for position in range(0, windows, chunk):
+            base = rng.choice(bases)
+            start = rng.randrange(max(base[-1][0] - chunk, 1))
+            rows.extend((songId, hashVal, position + offset - start)
+                    for offset, hashVal in base
+                    if start <= offset < start + chunk)
+    return rows
+
+def cutSnippets(rows, count, length, rng):
+    """Cut snippets of length time windows out of random songs. Returns
+    (songId, csv lines) pairs."""
+    bySong = {}
+    for songId, hashVal, offset in rows:
+        bySong.setdefault(songId, []).append((hashVal, offset))
+    snippets = []
+    for _ in range(count):
+        songId = rng.choice(list(bySong))
+        last = max(offset for _, offset in bySong[songId])
+        start = rng.randrange(max(last - length, 1))
+        lines = ['{},{}\n'.format(hashVal, offset - start)
+                for hashVal, offset in bySong[songId]
+                if start <= offset < start + length]
+        snippets.append((songId, lines))
+    return snippets
+
+def timeQueries(snippets, match):
+    """Run match on every snippet. Returns the sorted query times in ms and
+    the share of snippets whose best match was the right song."""
+    times = []
+    right = 0
+    for songId, lines in snippets:
+        start = time.perf_counter()
+        ranked = match(lines)
+        times.append(1000 * (time.perf_counter() - start))
+        if ranked and ranked[0][0] == songId:
+            right += 1
+    return sorted(times), right / len(snippets)
+
+def mixSnippets(snippets, rng):
+    """Pair up snippets into ones holding the fingerprints of two songs,
+    where pruning has close contests to get right."""
+    mixed = []
+    for (songId, lines), (_, other) in zip(snippets, snippets[1:]):
+        lines = lines + other
+        rng.shuffle(lines)
+        mixed.append((songId, lines))
+    return mixed
+
+def checkTopK(snippets, full, top, store):
+    """Check top(lines, k, margin, minMatches) against the full tally of
+    full(lines) on every snippet. Raises AssertionError on a mismatch and
+    returns the number of comparisons."""
+    defaults = (PrintMatcher.MARGIN, PrintMatcher.MATCHTHRESHOLD)
+    configs = [(1, 0, 0), (1,) + defaults, (3, 0, 0), (3,) + defaults]
+    checked = 0
+    for _, lines in snippets:
+        tally = full(lines)
+        for k, margin, minMatches in configs:
+            found = top(lines, k, margin, minMatches)
+            what = '{} k={} margin={} minMatches={}: {} against {}'.format(
+                    store, k, margin, minMatches, found,
+                    ranked(tally)[:k + 1])
+            assert len(found) == min(k, len(tally)), what
+            for songId, count in found:
+                assert count <= tally[songId], what
+            kept = {songId for songId, _ in found}
+            if kept:
+                lowest = min(tally[songId] for songId in kept)
+                assert all(count <= lowest for songId, count in tally.items()
+                        if songId not in kept), what
+            checked += 1
+    return checked
+
+def shardIndex(indexDir, shards, songs, rows):
+    """Build a sharded index of songs and rows, one segment per shard."""
+    ShardedIndex.initIndex(indexDir, shards)
+    shardRows = [[] for _ in range(shards)]
+    for row in rows:
+        shardRows[ShardedIndex.shardOf(row[1], shards)].append(row)
+    for shard in range(shards):
+        SegmentIndex.addSegment(ShardedIndex.shardDir(indexDir, shard),
+                songs, shardRows[shard])
+
+def ranked(matches):
+    return sorted(matches.items(), key=lambda m: m[1], reverse=True)
+
+def report(store, mode, times, accuracy):
+    p95 = times[min(len(times) - 1, int(0.95 * len(times)))]
+    print('{}\t{}\t{:.1f}\t{:.1f}\t{:.1f}\t{:.2f}'.format(store, mode,
+        sum(times) / len(times), p95, times[-1], accuracy))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="""Compare query latency of
+            full tallies and top-k matching on a dense, stitched catalog.""")
+    parser.add_argument('files', nargs='+',
+            help='FingerPrinter -s csv files or wav files to stitch from')
+    parser.add_argument('--songs', type=int, default=100)
+    parser.add_argument('--windows', type=int, default=200,
+            help='length of each stitched song in time windows')
+    parser.add_argument('--chunk', type=int, default=20,
+            help='length of each stitched piece in time windows')
+    parser.add_argument('--snippets', type=int, default=40)
+    parser.add_argument('--length', type=int, default=100,
+            help='length of each snippet in time windows')
+    parser.add_argument('--top-k', type=int, default=1)
+    parser.add_argument('--shards', default='1,2,4,8',
+            help='comma separated shard counts to time')
+    parser.add_argument('--fingerprinter', default='./FingerPrinter')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--check', action='store_true',
+            help='check top-k matching against full tallies, timing nothing')
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    _, baseRows = BenchPostings.loadRows(args.files, args.fingerprinter)
+    rows = stitchSongs(baseRows, args.songs, args.windows, args.chunk, rng)
+    songs = [(songId, 'song{}'.format(songId))
+            for songId in range(1, args.songs + 1)]
+    snippets = cutSnippets(rows, args.snippets, args.length, rng)
+    hashes = {row[1] for row in rows}
+    print('{} songs, {} postings, {} distinct hashes, {:.1f} songs per hash'
+            .format(args.songs, len(rows), len(hashes),
+                len({(r[0], r[1]) for r in rows}) / len(hashes)))
+
+    with tempfile.TemporaryDirectory() as workdir:
+        dbPath = os.path.join(workdir, 'bench.sqlite')
+        conn = sqlite3.connect(dbPath)
+        with open(DBINIT, 'r') as init:
+            conn.executescript(init.read())
+        conn.executemany('insert or ignore into songs values (?, ?)', songs)
+        conn.executemany(
+            'insert or ignore into fingerprints values (?, ?, ?)', rows)
+        conn.commit()
+        curs = conn.cursor()
+
+        indexDir = os.path.join(workdir, 'index')
+        SegmentIndex.initIndex(indexDir)
+        SegmentIndex.addSegment(indexDir, songs, rows)
+        snapshot = SegmentIndex.Snapshot(indexDir)
+
+        if args.check:
+            checked = snippets + mixSnippets(snippets, rng)
+            count = checkTopK(checked,
+                    lambda lines: PrintMatcher.matchesInDB(lines, curs),
+                    lambda lines, k, margin, minMatches:
+                        PrintMatcher.topMatches(lines,
+                            lambda hashes: PrintMatcher.hashCountsFromDB(
+                                curs, hashes),
+                            lambda hashVal: PrintMatcher.hashMatchesFromDB(
+                                curs, hashVal), k, margin,
+                            minMatches=minMatches), 'sqlite')
+            count += checkTopK(checked,
+                    lambda lines: PrintMatcher.matchesInIndex(lines,
+                        snapshot),
+                    lambda lines, k, margin, minMatches:
+                        PrintMatcher.topMatches(lines, snapshot.locate,
+                            snapshot.fetch, k, margin,
+                            minMatches=minMatches), 'segment')
+            print('top-k matches agree with full tallies in {} '
+                    'comparisons'.format(count))
+            snapshot.close()
+            conn.close()
+            sys.exit(0)
+
+        k = args.top_k
+        print('Store:\tMode:\tMean ms:\tp95 ms:\tWorst ms:\tTop-1 right:')
+        report('sqlite', 'full', *timeQueries(snippets,
+            lambda lines: ranked(PrintMatcher.matchesInDB(lines, curs))))
+        report('sqlite', 'top-' + str(k), *timeQueries(snippets,
+            lambda lines: PrintMatcher.topMatches(lines,
+                lambda hashes: PrintMatcher.hashCountsFromDB(curs, hashes),
+                lambda hashVal: PrintMatcher.hashMatchesFromDB(curs,
+                    hashVal), k)))
+        report('segment', 'full', *timeQueries(snippets,
+            lambda lines: ranked(PrintMatcher.matchesInIndex(lines,
+                snapshot))))
+        report('segment', 'top-' + str(k), *timeQueries(snippets,
+            lambda lines: PrintMatcher.topMatches(lines, snapshot.locate,
+                snapshot.fetch, k)))
+
+        snapshot.close()
+        conn.close()
+
+        print('Sharded, {} cores:'.format(os.cpu_count()))
+        print('Store:\tMode:\tMean ms:\tp95 ms:\tWorst ms:\tTop-1 right:')
+        for shards in (int(n) for n in args.shards.split(',')):
+            shardsDir = os.path.join(workdir, 'shards{}'.format(shards))
+            shardIndex(shardsDir, shards, songs, rows)
+            with ShardedIndex.ShardServer(shardsDir) as server:
+                report('{} shards'.format(shards), 'full',
+                        *timeQueries(snippets, lambda lines:
+                            ranked(server.match(lines))))
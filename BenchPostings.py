@@ -0,0 +1,110 @@
+# BenchPostings.py
+# Benchmark of the compressed posting list segments against the sqlite
+# fingerprint table. Loads the same fingerprints into both, then reports the
+# bytes each takes per posting and how many hash lookups per second each
+# serves.
+import argparse
+import os
+import random
+import sqlite3
+import subprocess
+import tempfile
+import time
+
+import Postings
+import PrintMatcher
+import SegmentIndex
+
+DBINIT = 'InitDatabase.sql'
+
+def loadRows(files, fingerprinter):
+    """Read (songId, hash, offset) rows from FingerPrinter -s csv files, or
+    fingerprint wav files with consecutive song ids."""
+    rows = []
+    songs = []
+    for songId, path in enumerate(files, 1):
+        if path.endswith('.wav'):
+            output = subprocess.run([fingerprinter, path, '-s', str(songId)],
+                    check=True, stdout=subprocess.PIPE,
+                    universal_newlines=True).stdout
+            songRows = [tuple(int(v) for v in line.split(','))
+                    for line in output.splitlines()]
+        else:
+            songRows = SegmentIndex.readCSVSong(path)
+        songs.append((songRows[0][0], SegmentIndex.titleOf(path)))
+        rows.extend(songRows)
+    return songs, rows
+
+def timeLookups(lookup, hashes):
+    """Returns (lookups per second, postings per second) for looking up
+    every hash in hashes with lookup."""
+    postings = 0
+    start = time.perf_counter()
+    for hashVal in hashes:
+        postings += len(lookup(hashVal))
+    seconds = time.perf_counter() - start
+    return len(hashes) / seconds, postings / seconds
+
+def timeTally(segment, hashes, binSize):
+    """Lookups per second when decoding straight into delta bins."""
+    matches = {}
+    newBins = lambda: PrintMatcher.DeltaBin(binSize)
+    start = time.perf_counter()
+    for hashVal in hashes:
+        segment.tally(hashVal, 0, matches, newBins)
+    return len(hashes) / (time.perf_counter() - start)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="""Compare the size and
+            lookup speed of compressed posting segments and sqlite.""")
+    parser.add_argument('files', nargs='+',
+            help='FingerPrinter -s csv files or wav files')
+    parser.add_argument('--lookups', type=int, default=20000)
+    parser.add_argument('--fingerprinter', default='./FingerPrinter')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    songs, rows = loadRows(args.files, args.fingerprinter)
+    random.seed(args.seed)
+
+    with tempfile.TemporaryDirectory() as workdir:
+        dbPath = os.path.join(workdir, 'bench.sqlite')
+        conn = sqlite3.connect(dbPath)
+        with open(DBINIT, 'r') as init:
+            conn.executescript(init.read())
+        conn.executemany('insert or ignore into songs values (?, ?)', songs)
+        conn.executemany(
+            'insert or ignore into fingerprints values (?, ?, ?)', rows)
+        conn.commit()
+        conn.execute('VACUUM')
+        curs = conn.cursor()
+
+        segPath = os.path.join(workdir, 'bench.seg')
+        postings = Postings.writeSegmentFile(segPath, songs, rows)
+        segment = Postings.Segment(segPath)
+
+        # Half of the lookups hit stored hashes, half are random misses,
+        # roughly like a snippet against a big catalog.
+        present = list({row[1] for row in rows})
+        hashes = [random.choice(present) if i % 2 == 0
+                else random.getrandbits(32) for i in range(args.lookups)]
+
+        sqlBytes = os.path.getsize(dbPath)
+        segBytes = os.path.getsize(segPath)
+        sqlRate, sqlPostings = timeLookups(
+            lambda h: PrintMatcher.hashMatchesFromDB(curs, h), hashes)
+        segRate, segPostings = timeLookups(segment.hashMatches, hashes)
+        tallyRate = timeTally(segment, hashes, PrintMatcher.BINSIZE)
+
+        print('{} songs, {} postings, {} distinct hashes'.format(
+            len(songs), postings, len(present)))
+        print('Store:\tBytes:\tBytes/posting:\tLookups/s:\tPostings/s:')
+        print('sqlite\t{}\t{:.2f}\t{:.0f}\t{:.0f}'.format(sqlBytes,
+            sqlBytes / postings, sqlRate, sqlPostings))
+        print('segment\t{}\t{:.2f}\t{:.0f}\t{:.0f}'.format(segBytes,
+            segBytes / postings, segRate, segPostings))
+        print('segment tally\t\t\t{:.0f}'.format(tallyRate))
+        print('compression: {:.1f}x'.format(sqlBytes / segBytes))
+
+        segment.close()
+        conn.close()
@@ -3,11 +3,14 @@
 
 echo "Printing all FULL wav files to sqlite file $1"
 
+# Unchanged files come straight out of the fingerprint cache.
+FPCACHE=${FPCACHE:-TestSet/cache}
+
 SONGID=1
 for f in TestSet/*FULL.wav
 do
     echo "Fingerprinting $f with songId $SONGID"
-    ./Fingerprinter $f -s $SONGID > "${f%.wav}ID.csv"
+    ./FingerPrinter $f -s $SONGID -c "$FPCACHE" > "${f%.wav}ID.csv"
     ((SONGID++))
 done
 
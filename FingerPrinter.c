@@ -1,413 +1,62 @@
-/* FingerPrinter.c - constructs an acoustic fingerprint from a wav file or
- * sequence of samples. */
+/* FingerPrinter.c - constructs an acoustic fingerprint from a wav file.
+ *
+ * A command line client of the fingerprinting library (Pipes.h): reads the
+ * samples of a wav file into memory, fingerprints them and prints the
+ * fingerprints, going through the fingerprint cache if asked to. */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <complex.h>
 #include <string.h>
-#include <assert.h>
-#include "FourierTransform.h"
+#include "Pipes.h"
 #include "WAVReading.h"
+#include "FingerprintCache.h"
 
-/* Initial capacity of peak vectors. */
-#define I_CAP 8
-
-/* Length of fourier transforms - how many samples are fed into fft. */
-#define FFT_LEN 4096
-
-/* Neighborhood on each side of a point which it must exceed to be a peak. */
-#define NEIGHBORHOOD 8
-
-/* Square size for experimental peak-finding algorithm.
- * Larger keeps peak numbers manageable, but hurts frequency and time res */
-#define SQUARESIZE 5
-
-/* Threshold for peaks - peaks must have at least this magnitude. */
-#define THRESHOLD 12000000.0
-
-/* Delta threshold for peaks - peaks must be at least this much greater than
- * their neighboring bins. */
-#define DELTA 10000.0
-
-/* Fanout factor for constellating peaks. For each peak, take the next FANOUT
- * peaks and make a fingerprint out of each of those pairs. */
-#define FANOUT 10 /* TODO: increase this and adjust everything else to keep
-                    fingerprint numbers reasonable. */
-
-
-/**********************
- * Peak Data Structures
- *
- * frequency-time peaks and dynamic vectors to hold a variable number of them.
- */
-
-/* Structure for frequency-time peaks. */
-typedef struct _Peak {
-    int frequency;
-    int timeWindow;
-} Peak;
 
-/* Frequency-time peak vectors. */
-typedef struct _PeakVector {
-    int capacity;
-    int elements;
-    Peak * peaks;
-} PeakVector;
 
-/* Initialize an empty peak vector. Allocates memory for the vector itself
- * and its contents, which starts as I_CAP peaks stored in contiguous memory.
+/* Take an array of hashed fingerprints and print them to stdout in a
+ * format that sql can read as csv.
  */
-PeakVector * newVector() {
-    PeakVector * new = malloc(sizeof(PeakVector));
-    if (new == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
-        exit(1);
-    }
-
-    new->capacity = I_CAP;
-    new->elements = 0;
-    new->peaks = malloc(sizeof(Peak) * I_CAP);
-    if (new->peaks == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
-        exit(1);
-    }
-
-    return new;
-}
-
-/* Get the peak at a given index in a peak vector. Exits if the index is
- * invalid, for safety. */
-Peak getPeak(PeakVector * vect, int index) {
-    if (index < 0 || index >= vect->elements) {
-        fprintf(stderr, "error! vector access at invalid index.\n");
-        exit(1);
-    }
-    return vect->peaks[index];
-}
-
-/* Append a peak to a peak vector, potentially resizing it. */
-void vectorAppend(PeakVector * vect, Peak pk) {
-
-    /* If the vector is full, increase its capacity by double. */
-    if (vect->elements == vect->capacity) {
-        vect->capacity *= 2;
-        vect->peaks = realloc(vect->peaks, sizeof(Peak) * vect->capacity);
-        if (vect->peaks == NULL) {
-            fprintf(stderr, "error! Out of memory.\n");
-            exit(1);
-        }
-    }
-
-    vect->peaks[vect->elements] = pk;
-    vect->elements++;
-}
-
-/* Free all memory associated with a vector. Also frees the pointer passed. */
-void freeVector(PeakVector * vect) {
-    free(vect->peaks);
-    free(vect);
-}
-
-/* Compute the time-frequency spectrogram of a given WAV file. These can be
- * pretty big, around 2Gb for a 5-minute song. */
-double complex ** computeSpectrogram(
-        FILE * infile, int m, int channels, int windows) {
-
-    /* Allocate memory for the spectrogram - an array of arrays, one for each
-     * time window, each containing the fourier transform frequency profile
-     * of that time window. */
-    double complex ** spectrogram = malloc(sizeof(double complex *) * windows);
-    if (spectrogram == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
-        exit(1);
-    }
-
-    /* This pointer lets us chase the spectrogram and do our ffts but still
-     * return the start of the spectrogram. Replace with pointer arithmetic
-     * later when windows has been vetted. */
-    double complex ** fft = spectrogram;
-
-    /* Read in the first m values from the file. */
-    double complex * inputs = malloc(sizeof(double complex) * m);
-    if (inputs == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
-        exit(1);
-    }
-
-    int fileEnd = getNextMValues(infile, inputs, m, channels) != m;
+void printFingerprints(const PipesPrint * prints, int count, int songId) {
     
-    if (fileEnd) {
-        fprintf(stderr, "error: Could not get %d samples from wav file.\n", m);
-        exit(1);
-    }
-
-    /* Compute the fourier transform of the first window. */
-
-    /* While there's new data, repeatedly shift the array of inputs, read the
-     * next m/2 values in, and take a new fourier transform. */
-
-    do {
-        *fft = fastFourierTransform(inputs, m);
-        fft++;
-        windows--;
-
-        /* Shift the array and read the next m/2 values. */
-        for (int i = 0; i < m/2; i++)
-            inputs[i] = inputs[i + m/2];
-
-        fileEnd = getNextMValues(infile, inputs, m/2, channels) != m/2;
-    } while (!fileEnd);
-
-    /* fileEnd should be replaced by feof function. */
-    assert(feof(infile));
-
-    /* Make sure the windows calculation was accurate. */
-    assert(windows == 0);
-
-    return spectrogram;
-}
-
-/* Second version of computePeaks, which holds the spectrogram in memory
- * to find peaks. 
- *
- * This works by breaking up the spectrogram into squares of a given
- * side length, finding the max in each of those squares, and cutting off
- * based on a threshold. */
-PeakVector * computePeaksNew(FILE * infile, int m, int channels, int windows) {
-
-    /* First, compute the spectrogram. */
-    double complex ** spectrogram
-        = computeSpectrogram(infile, m, channels, windows);
-
-    /* Now, iterate over the spectrogram's square regions, collecting peaks.
-     * For now, very simplistic brute-force algorithm. */
-    PeakVector * peaks = newVector();
-
-    for (int i = 0; i < windows - SQUARESIZE; i += SQUARESIZE) {
-        for (int j = 0; j < m - SQUARESIZE; j += SQUARESIZE) {
-            double maxAmplitude = THRESHOLD;
-            int frequency = -1;
-            int timeWindow = -1;
-            for (int x = 0; x < SQUARESIZE; x++) {
-                for (int y = 0; y < SQUARESIZE; y++) {
-                    double amp = cabs(spectrogram[i+x][j+y]);
-                    if (amp > maxAmplitude) {
-                        maxAmplitude = amp;
-                        frequency = j + y;
-                        timeWindow = i + x;
-                    }
-                }
-            }
-
-            if (frequency != -1) {
-                Peak p = { .frequency = frequency, .timeWindow = timeWindow };
-                vectorAppend(peaks, p);
-            }
-        }
-    }
-
-    return peaks;
-}
-
-
-/* Compute the time-frequency peaks from the samples in a given WAV file. */
-PeakVector * computePeaks(FILE * infile, int m, int channels) {
-    PeakVector * result = newVector();
-    
-    /* Read the first m values into the array of the inputs. */
-    double complex * inputs = malloc(sizeof(double complex) * m);
-    if (inputs == NULL) {
-        fprintf(stderr, "ERR out of memory\n");
-        exit(1);
-    }
-    
-    getNextMValues(infile, inputs, m, channels);
-
-    double complex * oldFFTValues = fastFourierTransform(inputs, m);
-
-    PeakVector * potentials = newVector();
-    int t = 0;
-
-    double complex * nextFFTValues;
-
-    for (int i = 0; i < m/2; i++)
-        inputs[i] = inputs[i + m/2];
-
-    int fileEnd = (getNextMValues(infile, inputs + m/2, m/2, channels) != m/2);
-    /* Read till the end of the file, collecting peaks. */
-    while (!fileEnd) {
-        
-        nextFFTValues = fastFourierTransform(inputs, m);
-
-        /* Check if we confirmed any potential peaks. */
-        for (int i = 0; i < potentials->elements; i++) {
-            Peak poss = getPeak(potentials, i);
-            if (cabs(oldFFTValues[poss.frequency]) >
-                    cabs(nextFFTValues[poss.frequency])) {
-                /* peak confirmed. */
-                vectorAppend(result, poss);
-            }
-        }
-
-        freeVector(potentials);
-        potentials = newVector();
-        for (int i = NEIGHBORHOOD; i < m - NEIGHBORHOOD; i++) {
-            double mag = cabs(nextFFTValues[i]);
-            int isPeak = 1;
-            for (int j = 1; j <= NEIGHBORHOOD; j++) {
-                isPeak = isPeak && mag > cabs(nextFFTValues[i+j]) + DELTA;
-                isPeak = isPeak && mag > cabs(nextFFTValues[i-j]) + DELTA;
-            }
-            isPeak = isPeak && mag > cabs(oldFFTValues[i]) + DELTA;
-            isPeak = isPeak && mag > THRESHOLD;
-            if (isPeak) {
-                /* found a potential peak! */
-                Peak poss = { .frequency = i, .timeWindow = t };
-                vectorAppend(potentials, poss);
-            }
-        }
-
-        /* Move the new fourier transform values into the old array. */
-        for (int i = 0; i < m; i++) {
-            oldFFTValues[i] = nextFFTValues[i];
-        }
-
-        free(nextFFTValues);
-
-        t++;
-
-        fileEnd = (getNextMValues(infile, inputs + m/2, m/2, channels) != m/2);
+    for (int i = 0; i < count; i++) {
+        if (songId)
+            printf("%d,%u,%u\n", songId, prints[i].hash,
+                    prints[i].timeWindow);
+        else
+            printf("%u,%u\n", prints[i].hash, prints[i].timeWindow);
     }
-
-    return result;
 }
 
-/* Structure of a fingerprint. */
-typedef struct _Fingerprint {
-    /* The time window of the first peak that makes up this fingerprint. */
-    int timeWindow;
+/* Compute the fingerprint cache key of a wav file: a hash of the whole file
+ * along with the library's algorithm version and every parameter that changes
+ * the fingerprints it produces. */
+uint64_t cacheKey(FILE * wav, PipesParams * params) {
+    uint64_t key = 0xcbf29ce484222325ull;
+    int version = pipesVersion();
 
-    /* The values that actually make up the hash of these fingerprints. */
-    /* The frequencies of the two peaks in the fingerprint. */
-    int frequency1;
-    int frequency2;
-    /* The time difference between the two peaks. */
-    int timeDifference;
-} Fingerprint;
+    key = hashBytes(key, &version, sizeof(int));
+    key = hashBytes(key, &params->streaming, sizeof(int));
+    key = hashBytes(key, &params->fftLen, sizeof(int));
+    key = hashBytes(key, &params->neighborhood, sizeof(int));
+    key = hashBytes(key, &params->squareSize, sizeof(int));
+    key = hashBytes(key, &params->threshold, sizeof(double));
+    key = hashBytes(key, &params->delta, sizeof(double));
+    key = hashBytes(key, &params->fanout, sizeof(int));
+    key = hashBytes(key, &params->peakRate, sizeof(double));
 
-/* Package a pair of peaks into a fingerprint. */
-Fingerprint fromPeaks(Peak p1, Peak p2) {
-    Fingerprint result = { .timeWindow = p1.timeWindow,
-        .frequency1 = p1.frequency,
-        .frequency2 = p2.frequency,
-        .timeDifference = p2.timeWindow - p1.timeWindow };
-    return result;
+    return hashFile(key, wav);
 }
 
-/* fingerprint vectors. */
-/* TODO: use generic void * vectors? */
-typedef struct _FingerprintVector {
-    int capacity;
-    int elements;
-    Fingerprint * fingerprints;
-} FingerprintVector;
-
-/* Initialize an empty fingerprint vector */
-FingerprintVector * newFPVector() {
-    FingerprintVector * new = malloc(sizeof(FingerprintVector));
-    if (new == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
+/* Consume the value that follows a command line option, exiting with an
+ * error if the option was the last argument. */
+char * optionValue(int * argc, char *** argv) {
+    if (*argc < 2) {
+        fprintf(stderr, "error! option %s needs a value.\n", **argv);
         exit(1);
     }
-
-    new->capacity = I_CAP;
-    new->elements = 0;
-    new->fingerprints = malloc(sizeof(Fingerprint) * I_CAP);
-    if (new->fingerprints == NULL) {
-        fprintf(stderr, "error! Out of memory.\n");
-        exit(1);
-    }
-
-    return new;
-}
-
-/* Get the fingerprint at a given index in a fingerprint vector. */
-Fingerprint getFingerprint(FingerprintVector * vect, int index) {
-    if (index < 0 || index >= vect->elements) {
-        fprintf(stderr, "error! vector access at invalid index.\n");
-        exit(1);
-    }
-    return vect->fingerprints[index];
-}
-
-/* Append a fingerprint to a fingerprint vector, potentially resizing it. */
-void vectorFPAppend(FingerprintVector * vect, Fingerprint fp) {
-    if (vect->elements == vect->capacity) {
-        vect->capacity *= 2;
-        vect->fingerprints =
-            realloc(vect->fingerprints, sizeof(Fingerprint) * vect->capacity);
-        if (vect->fingerprints == NULL) {
-            fprintf(stderr, "error! Out of memory.\n");
-            exit(1);
-        }
-    }
-
-    vect->fingerprints[vect->elements] = fp;
-    vect->elements++;
-}
-
-/* Free the memory associated with a vector. Also frees the pointer passed. */
-void freeFPVector(FingerprintVector * vect) {
-    free(vect->fingerprints);
-    free(vect);
-}
-
-/* Fingerprint all of the peaks in a given peak vector. Returns a vector
- * of the fingerprints that were generated. */
-FingerprintVector * fingerprintPeaks(PeakVector * pv) {
-
-    FingerprintVector * result = newFPVector();
-    
-    for (int i = 0; i < pv->elements; i++) {
-        for (int j = 0; j < FANOUT; j++) {
-            if (i + j < pv->elements) {
-                Fingerprint fp = fromPeaks(getPeak(pv, i), getPeak(pv, i+j));
-                vectorFPAppend(result, fp);
-            }
-        }
-    }
-
-    return result;
-}
-
-
-/* Hash a given fingerprint's two frequencies as well as time delta together.
- *
- * Currently, the hash function naively assumes that each of these three
- * values will be less than 16 bits long to get a no-collision hash by just
- * concatenating the bits together. Later we can make a better space/collisions
- * tradeoff with a real hash function.
- */
-unsigned int basicHash(Fingerprint fp) {
-    unsigned int hash = fp.frequency1;
-    hash = (hash << 16) + fp.frequency2;
-    hash = (hash << 16) + fp.timeDifference;
-    return hash;
-}
-
-/* Take a vector of fingerprint structures and print hashes to stdout in a
- * format that sql can read as csv.
- */
-void printFingerprints(FingerprintVector * fps, int songId) {
-    
-    for (int i = 0; i < fps->elements; i++) {
-        Fingerprint fp = getFingerprint(fps, i);
-        unsigned int hash = basicHash(fp);
-        if (songId)
-            printf("%d,%u,%u\n", songId, hash, fp.timeWindow);
-        else
-            printf("%u,%u\n", hash, fp.timeWindow);
-    }
+    (*argc)--;
+    (*argv)++;
+    return **argv;
 }
 
 /********
@@ -424,23 +73,57 @@ void printFingerprints(FingerprintVector * fps, int songId) {
  *               importing to sqlite.
  * -v : verbose, a debug mode where fingerprints are not printed to stdout
  *      but some information about the fingerprinting process is given.
+ *
+ * parameter overrides (defaults are the defines at the top of Pipes.c):
+ * -n <fftLen>       : samples per fourier transform, a power of two.
+ * -N <neighborhood> : neighborhood size for the streaming peak finder.
+ * -q <squareSize>   : side length of the peak-finding squares.
+ * -t <threshold>    : minimum magnitude of a peak.
+ * -d <delta>        : how much a peak must exceed its neighbors by.
+ * -f <fanout>       : how many following peaks each peak is paired with.
+ * -p <peakRate>     : adaptive peak selection, keeping about this many peaks
+ *                     per second of audio instead of using the threshold.
+ *                     0 turns it off.
+ * -S : use the streaming peak finder, which doesn't hold the whole
+ *      spectrogram in memory.
+ * -c <cacheDir> : keep fingerprints in a cache directory, keyed by the
+ *                 contents of the wav file and the parameters above. Files
+ *                 that were already fingerprinted the same way are read
+ *                 back from the cache instead.
  */
 int main(int argc, char *argv[]) {
 
     int songId = 0;
     int verbose = 0;
     char * filename = NULL;
+    char * cacheDir = NULL;
+    PipesParams params = pipesDefaultParams();
     /* Parse command line arguments. */
     argc--;
     argv++;
     while (argc > 0) {
         if (strcmp(*argv, "-v") == 0)
             verbose = 1;
-        else if (strcmp(*argv, "-s") == 0) {
-            argc--;
-            argv++;
-            songId = atoi(*argv);
-        }
+        else if (strcmp(*argv, "-S") == 0)
+            params.streaming = 1;
+        else if (strcmp(*argv, "-s") == 0)
+            songId = atoi(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-n") == 0)
+            params.fftLen = atoi(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-N") == 0)
+            params.neighborhood = atoi(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-q") == 0)
+            params.squareSize = atoi(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-t") == 0)
+            params.threshold = atof(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-d") == 0)
+            params.delta = atof(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-f") == 0)
+            params.fanout = atoi(optionValue(&argc, &argv));
+        else if (strcmp(*argv, "-c") == 0)
+            cacheDir = optionValue(&argc, &argv);
+        else if (strcmp(*argv, "-p") == 0)
+            params.peakRate = atof(optionValue(&argc, &argv));
         else
             filename = *argv;
 
@@ -448,28 +131,87 @@ int main(int argc, char *argv[]) {
         argv++;
     }
 
+    if (filename == NULL) {
+        fprintf(stderr, "error! no wav file given.\n");
+        exit(1);
+    }
+
+    PipesContext * context;
+    int error = pipesNewContext(&context, &params);
+    if (error) {
+        fprintf(stderr, "error! %s.\n", pipesError(error));
+        exit(1);
+    }
+
     FILE * wav = fopen(filename, "r");
+    if (wav == NULL) {
+        fprintf(stderr, "error! could not open %s.\n", filename);
+        exit(1);
+    }
     int channels = readWAVChannels(wav);
+    int sampleRate = readWAVSampleRate(wav);
+    if (channels < 1) {
+        fprintf(stderr, "error! %s has no channels.\n", filename);
+        exit(1);
+    }
     int length = readWAVLength(wav, channels);
-    int windows = (length / (FFT_LEN / 2)) - 1;
+    int windows = (length / (params.fftLen / 2)) - 1;
 
     if (verbose) {
-        printf("detected %d channels.\n", channels);
+        printf("detected %d channels at %d Hz.\n", channels, sampleRate);
         printf("with a total length of %d.\n", length);
         printf("and %d windows.\n", windows);
+        printf("fft length %d, square size %d, threshold %.1f, fanout %d.\n",
+                params.fftLen, params.squareSize, params.threshold,
+                params.fanout);
+        if (params.peakRate > 0)
+            printf("adaptive peak selection at %.1f peaks per second.\n",
+                    params.peakRate);
+    }
+
+    uint64_t key = 0;
+    if (cacheDir != NULL) {
+        key = cacheKey(wav, &params);
+
+        PipesPrint * cached;
+        int count;
+        if (cacheRead(cacheDir, key, &cached, &count)) {
+            if (verbose)
+                printf("cache hit with %d fingerprints.\n", count);
+            else
+                printFingerprints(cached, count, songId);
+            free(cached);
+            pipesFreeContext(context);
+            fclose(wav);
+            return 0;
+        }
     }
 
-    PeakVector * peaks = computePeaksNew(wav, FFT_LEN, channels, windows);
+    int frames;
+    int16_t * samples = readWAVSamples(wav, channels, &frames);
+    fclose(wav);
+
+    const PipesPrint * prints;
+    int count;
+    error = pipesFingerprint(context, samples, frames, channels, sampleRate,
+            &prints, &count);
+    if (error) {
+        fprintf(stderr, "error! %s: %s.\n", filename, pipesError(error));
+        exit(1);
+    }
+
+    if (cacheDir != NULL && cacheWrite(cacheDir, key, prints, count))
+        fprintf(stderr, "warning: could not write to cache %s.\n", cacheDir);
 
-    FingerprintVector * prints = fingerprintPeaks(peaks);
-    
     if (verbose) {
-        printf("detected %d peaks.\n", peaks->elements);
-        printf("and created %d fingerprints.\n", prints->elements);
+        printf("detected %d peaks.\n", pipesLastPeakCount(context));
+        printf("and created %d fingerprints.\n", count);
     }
     else {
-        printFingerprints(prints, songId);
+        printFingerprints(prints, count, songId);
     }
 
+    free(samples);
+    pipesFreeContext(context);
     return 0;
 }
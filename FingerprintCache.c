@@ -0,0 +1,185 @@
+/* FingerprintCache.c
+ *
+ * A content-addressed, on-disk cache of fingerprints. Entries are keyed by a
+ * hash of the audio file's bytes and the fingerprinting parameters, so an
+ * unchanged file fingerprinted the same way is read straight back instead of
+ * going through the fourier transforms again.
+ *
+ * Each entry is a file named by its key in hex, holding a magic number, a
+ * fingerprint count and that many (hash, timeWindow) pairs.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FingerprintCache.h"
+
+/* Magic number at the start of every cache entry. */
+#define CACHE_MAGIC 0x31504650u /* "PFP1" */
+
+/* Size of the chunks files are read in while hashing. */
+#define HASH_CHUNK 65536
+
+/* Multipliers for the hash, from 64-bit FNV and splitmix. */
+#define HASH_PRIME 0x100000001b3ull
+#define MIX_PRIME 0xbf58476d1ce4e5b9ull
+
+/* Folds the bytes of a buffer into a running 64-bit hash. Whole 8-byte
+ * words go in at a time, which is several times faster than byte-wise FNV
+ * on the multi-megabyte sample data of a wav file. */
+uint64_t hashBytes(uint64_t hash, const void * data, size_t n) {
+    const unsigned char * bytes = data;
+
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * MIX_PRIME;
+        hash ^= hash >> 31;
+        bytes += 8;
+        n -= 8;
+    }
+
+    while (n > 0) {
+        hash = (hash ^ *bytes) * HASH_PRIME;
+        bytes++;
+        n--;
+    }
+
+    return hash;
+}
+
+/* Hashes the entire contents of a file, folding them into a running hash.
+ * Leaves the file pointer at the beginning of the sample values in the file,
+ * like the WAV header readers. */
+uint64_t hashFile(uint64_t hash, FILE * infile) {
+
+    unsigned char * buffer = malloc(HASH_CHUNK);
+    if (buffer == NULL) {
+        fprintf(stderr, "hashFile: error! Out of memory.\n");
+        exit(1);
+    }
+
+    if (fseek(infile, 0, SEEK_SET)) {
+        fprintf(stderr, "hashFile: error seeking file.\n");
+        exit(1);
+    }
+
+    size_t got;
+    while ((got = fread(buffer, 1, HASH_CHUNK, infile)) > 0)
+        hash = hashBytes(hash, buffer, got);
+
+    if (ferror(infile)) {
+        fprintf(stderr, "hashFile: error reading file.\n");
+        exit(1);
+    }
+
+    /* Seek to the beginning of the data section. */
+    if (fseek(infile, 44, SEEK_SET)) {
+        fprintf(stderr, "hashFile: error seeking file.\n");
+        exit(1);
+    }
+
+    free(buffer);
+    return hash;
+}
+
+/* Builds the path of the cache entry for a key into path, which must hold
+ * strlen(cacheDir) + 24 characters. */
+void entryPath(char * path, const char * cacheDir, uint64_t key) {
+    sprintf(path, "%s/%016llx.fp", cacheDir, (unsigned long long) key);
+}
+
+/* Looks up the fingerprints cached under a key. On a hit, returns 1 and
+ * points prints at a newly allocated array of count fingerprints, which the
+ * caller frees. Returns 0 on a miss. An unreadable or corrupt entry, or one
+ * there isn't memory for, is a miss too, so reading the cache never exits. */
+int cacheRead(const char * cacheDir, uint64_t key,
+        PipesPrint ** prints, int * count) {
+
+    char * path = malloc(strlen(cacheDir) + 24);
+    if (path == NULL)
+        return 0;
+    entryPath(path, cacheDir, key);
+
+    FILE * entry = fopen(path, "rb");
+    free(path);
+    if (entry == NULL)
+        return 0;
+
+    /* The count must fit in the file, so a corrupt header can't ask for
+     * more memory than the entry holds. */
+    struct stat info;
+    uint32_t header[2];
+    if (fstat(fileno(entry), &info) || info.st_size < 8
+            || fread(header, sizeof(uint32_t), 2, entry) != 2
+            || header[0] != CACHE_MAGIC
+            || header[1] > (uint64_t) (info.st_size - 8) / sizeof(PipesPrint)
+            || header[1] > INT_MAX) {
+        fclose(entry);
+        return 0;
+    }
+
+    *count = header[1];
+    *prints = malloc(sizeof(PipesPrint) * (*count > 0 ? *count : 1));
+    if (*prints == NULL) {
+        fclose(entry);
+        return 0;
+    }
+
+    if (fread(*prints, sizeof(PipesPrint), *count, entry)
+            != (size_t) *count) {
+        /* A truncated entry is just a miss. */
+        free(*prints);
+        fclose(entry);
+        return 0;
+    }
+
+    fclose(entry);
+    return 1;
+}
+
+/* Stores fingerprints in the cache under a key, creating the cache
+ * directory if needed. The entry is written to a temporary file and renamed
+ * into place, so concurrent readers never see half an entry. Returns 0 on
+ * success and -1 if the entry couldn't be written, which callers can treat
+ * as a warning. */
+int cacheWrite(const char * cacheDir, uint64_t key,
+        const PipesPrint * prints, int count) {
+
+    if (mkdir(cacheDir, 0777) && errno != EEXIST)
+        return -1;
+
+    char * path = malloc(strlen(cacheDir) + 24);
+    char * tmp = malloc(strlen(cacheDir) + 48);
+    if (path == NULL || tmp == NULL) {
+        fprintf(stderr, "cacheWrite: error! Out of memory.\n");
+        exit(1);
+    }
+    entryPath(path, cacheDir, key);
+    sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+
+    int result = -1;
+    FILE * entry = fopen(tmp, "wb");
+    if (entry != NULL) {
+        uint32_t header[2] = { CACHE_MAGIC, (uint32_t) count };
+        int ok = fwrite(header, sizeof(uint32_t), 2, entry) == 2
+            && fwrite(prints, sizeof(PipesPrint), count, entry)
+                == (size_t) count;
+        ok = (fclose(entry) == 0) && ok;
+        if (ok && rename(tmp, path) == 0)
+            result = 0;
+        else
+            remove(tmp);
+    }
+
+    free(path);
+    free(tmp);
+    return result;
+}
@@ -0,0 +1,14 @@
+/* FingerprintCache.h */
+#include <stdio.h>
+#include <stdint.h>
+#include "Pipes.h"
+
+uint64_t hashBytes(uint64_t hash, const void * data, size_t n);
+
+uint64_t hashFile(uint64_t hash, FILE * infile);
+
+int cacheRead(const char * cacheDir, uint64_t key,
+        PipesPrint ** prints, int * count);
+
+int cacheWrite(const char * cacheDir, uint64_t key,
+        const PipesPrint * prints, int count);
@@ -81,6 +81,83 @@ double complex * fastFourierTransform(double complex * input, int n) {
     return result;
 }
 
+/* Builds the tables for in-place fourier transforms of length n, which must
+ * be a power of two. Returns NULL if out of memory, so library callers can
+ * recover; free the plan with freeFFTPlan. */
+FFTPlan * newFFTPlan(int n) {
+    assert(isPowerofTwo(n));
+
+    FFTPlan * plan = malloc(sizeof(FFTPlan));
+    if (plan == NULL)
+        return NULL;
+
+    plan->n = n;
+    plan->reversed = malloc(sizeof(int) * n);
+    plan->twiddles = malloc(sizeof(double complex) * (n / 2 > 0 ? n / 2 : 1));
+    if (plan->reversed == NULL || plan->twiddles == NULL) {
+        freeFFTPlan(plan);
+        return NULL;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < n)
+        bits++;
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->reversed[i] = r;
+    }
+
+    /* Same expression as fftHelper's, so both transforms agree to the bit. */
+    for (int k = 0; k < n / 2; k++)
+        plan->twiddles[k] = cexp(-2.0 * M_PI * I * k / n);
+
+    return plan;
+}
+
+/* Frees a plan made by newFFTPlan. */
+void freeFFTPlan(FFTPlan * plan) {
+    if (plan == NULL)
+        return;
+    free(plan->reversed);
+    free(plan->twiddles);
+    free(plan);
+}
+
+/* Runs a fast fourier transform of plan->n values in place. This is the
+ * iterative form of the Cooley-Tukey algorithm in fastFourierTransform:
+ * inputs are put in bit-reversed order, then the same butterflies run level
+ * by level with twiddle factors from the plan instead of cexp, and nothing is
+ * allocated. */
+void plannedFourierTransform(FFTPlan * plan, double complex * data) {
+    int n = plan->n;
+
+    for (int i = 0; i < n; i++) {
+        int r = plan->reversed[i];
+        if (i < r) {
+            double complex temp = data[i];
+            data[i] = data[r];
+            data[r] = temp;
+        }
+    }
+
+    for (int len = 2; len <= n; len *= 2) {
+        int half = len / 2;
+        int stride = n / len;
+        for (int start = 0; start < n; start += len) {
+            double complex * even = data + start;
+            double complex * odd = even + half;
+            for (int i = 0; i < half; i++) {
+                double complex twiddled = plan->twiddles[i * stride] * odd[i];
+                double complex temp = even[i];
+                even[i] = temp + twiddled;
+                odd[i] = temp - twiddled;
+            }
+        }
+    }
+}
+
 
 /* Slides a fourier transform to the next window of time samples.
  * This is a destructive process and will overwrite the fourier coefficients
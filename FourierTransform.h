@@ -4,9 +4,27 @@
 #define M_PI   3.14159265358979323846
 #endif
 
+/* Precomputed tables for repeated in-place fourier transforms of one
+ * length. */
+typedef struct _FFTPlan {
+    int n;
+    /* Index of each input in bit-reversed order. */
+    int * reversed;
+    /* exp(-2 pi i k / n) for k < n / 2. */
+    double complex * twiddles;
+} FFTPlan;
+
+int isPowerofTwo(int n);
+
 double complex * slowFourierTransform(double complex * input, int n);
 
 double complex * fastFourierTransform(double complex * input, int n);
 
+FFTPlan * newFFTPlan(int n);
+
+void freeFFTPlan(FFTPlan * plan);
+
+void plannedFourierTransform(FFTPlan * plan, double complex * data);
+
 void fourierSlide(double complex * fourierResults, double complex * output,
         double complex earlyInput, double complex nextInput, int n);
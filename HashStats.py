@@ -0,0 +1,193 @@
+# HashStats.py
+# Hash frequency analysis and stoplisting.
+# Reports how many songs each fingerprint hash shows up in (its document
+# frequency) across a catalog. Hashes found in a large share of the songs,
+# like low frequency pairs a few windows apart or the self pairs
+# fingerprintPeaks makes by pairing a peak with itself, make up a lot of the
+# index and the lookups but say little about which song a snippet is from.
+# Those above a cutoff can be written out as a stoplist, or installed into an
+# index, which then drops them at ingest and ignores them at query time.
+import argparse
+import heapq
+import os
+import sqlite3
+from collections import Counter
+
+import SegmentIndex
+import ShardedIndex
+
+# Default cutoff: hashes in more than this share of the songs are stoplisted.
+STOPFRACTION = 0.5
+
+############################################################################
+### Gathering frequencies
+###
+
+class HashFrequencies:
+    """Per-hash document frequency (number of songs) and posting counts,
+    plus how many bytes of index their postings take where that's known."""
+
+    def __init__(self):
+        self.songs = 0
+        self.df = Counter()
+        self.postings = Counter()
+        self.postingBytes = Counter()
+        self.indexBytes = 0
+
+    def totalPostings(self):
+        return sum(self.postings.values())
+
+def indexDirs(path):
+    """The segment index directories of an index, sharded or not."""
+    if ShardedIndex.isShardedIndex(path):
+        return [ShardedIndex.shardDir(path, shard)
+                for shard in range(ShardedIndex.shardCount(path))]
+    return [path]
+
+def fromIndex(path):
+    """Gather hash frequencies from a (sharded) segment index."""
+    stats = HashFrequencies()
+    songs = set()
+    for directory in indexDirs(path):
+        with SegmentIndex.Snapshot(directory) as snapshot:
+            songs.update(songId for songId, _ in snapshot.songs())
+            for seg, segment in zip(snapshot.manifest['segments'],
+                    snapshot.segments):
+                stats.indexBytes += os.path.getsize(
+                        os.path.join(directory, seg['name']))
+                # A song is only ever in one segment of a shard, so counting
+                # the distinct songs of a hash per segment and adding up
+                # gives its document frequency.
+                for hashVal, _, start, end in segment.directory():
+                    hashSongs = set()
+                    for songId, _ in segment.decode(start, end):
+                        if songId not in snapshot.tombstones:
+                            hashSongs.add(songId)
+                            stats.postings[hashVal] += 1
+                    stats.df[hashVal] += len(hashSongs)
+                    stats.postingBytes[hashVal] += end - start
+    stats.songs = len(songs)
+    return stats
+
+def fromSQL(path):
+    """Gather hash frequencies from a sqlite fingerprint database. Posting
+    bytes are estimated by spreading the file size evenly over rows."""
+    stats = HashFrequencies()
+    conn = sqlite3.connect(path)
+    curs = conn.cursor()
+    curs.execute('SELECT COUNT(DISTINCT songId) FROM fingerprints')
+    stats.songs = curs.fetchone()[0]
+    curs.execute('SELECT hash, COUNT(DISTINCT songId), COUNT(*) '
+            'FROM fingerprints GROUP BY hash')
+    for hashVal, df, postings in curs:
+        stats.df[hashVal] = df
+        stats.postings[hashVal] = postings
+    conn.close()
+
+    stats.indexBytes = os.path.getsize(path)
+    perRow = stats.indexBytes / max(stats.totalPostings(), 1)
+    for hashVal, postings in stats.postings.items():
+        stats.postingBytes[hashVal] = postings * perRow
+    return stats
+
+def stoplistFor(stats, fraction=STOPFRACTION, maxDf=None):
+    """Hashes found in more than fraction of the songs, or in more than
+    maxDf songs if that's given."""
+    if maxDf is None:
+        maxDf = fraction * stats.songs
+    return {hashVal for hashVal, df in stats.df.items() if df > maxDf}
+
+############################################################################
+### Reporting
+###
+
+def dfBucket(df):
+    """Power of two bucket of a document frequency, as (low, high)."""
+    high = 1
+    while high < df:
+        high *= 2
+    return (high // 2 + 1 if high > 1 else 1), high
+
+def report(stats, stoplist, top):
+    postings = stats.totalPostings()
+    print('Songs: {}\tPostings: {}\tDistinct hashes: {}'.format(
+        stats.songs, postings, len(stats.df)))
+
+    # basicHash shifts frequency1 out of its 32 bits, leaving frequency2
+    # above the time difference.
+    zero = sum(n for hashVal, n in stats.postings.items()
+            if hashVal & 0xffff == 0)
+    print('Postings with no time difference (incl. self pairs): '
+            '{} ({:.1f}%)'.format(zero, 100 * zero / max(postings, 1)))
+
+    buckets = Counter()
+    bucketPostings = Counter()
+    for hashVal, df in stats.df.items():
+        buckets[dfBucket(df)] += 1
+        bucketPostings[dfBucket(df)] += stats.postings[hashVal]
+    print('\nSongs per hash:\tHashes:\tPostings:\t%Postings:')
+    for low, high in sorted(buckets):
+        label = str(low) if low == high else '{}-{}'.format(low, high)
+        print('{}\t{}\t{}\t{:.1f}'.format(label, buckets[(low, high)],
+            bucketPostings[(low, high)],
+            100 * bucketPostings[(low, high)] / max(postings, 1)))
+
+    print('\nHash:\tSongs:\tPostings:\tFrequency2:\tTimeDiff:')
+    for hashVal in heapq.nlargest(top, stats.df,
+            key=lambda h: (stats.df[h], stats.postings[h])):
+        print('{}\t{}\t{}\t{}\t{}'.format(hashVal, stats.df[hashVal],
+            stats.postings[hashVal], hashVal >> 16, hashVal & 0xffff))
+
+    stopped = sum(stats.postings[h] for h in stoplist)
+    stoppedBytes = sum(stats.postingBytes[h] for h in stoplist)
+    print('\nStoplist: {} hashes, {} postings ({:.1f}%), '
+            'about {:.0f} of {} index bytes ({:.1f}%)'.format(
+                len(stoplist), stopped, 100 * stopped / max(postings, 1),
+                stoppedBytes, stats.indexBytes,
+                100 * stoppedBytes / max(stats.indexBytes, 1)))
+
+############################################################################
+
+usageString = """Report the hash frequency distribution of a catalog, a sqlite
+file or a (sharded) segment index directory, and build a stoplist of hashes
+found in too many songs. An installed stoplist is enforced by the index at
+ingest and query time; PrintMatcher.py --stoplist applies a written one to
+other sources."""
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=usageString)
+    parser.add_argument('catalog', help='sqlite file or index directory')
+    parser.add_argument('--top', type=int, default=20,
+            help='how many of the most common hashes to list')
+    parser.add_argument('--fraction', type=float, default=STOPFRACTION,
+            help='stoplist hashes in more than this share of songs')
+    parser.add_argument('--max-df', type=int,
+            help='stoplist hashes in more than this many songs')
+    parser.add_argument('--write', help='write the stoplist to this file')
+    parser.add_argument('--install', action='store_true',
+            help='add the stoplist to the index\'s installed one')
+    parser.add_argument('--replace', action='store_true',
+            help='with --install, drop the installed stoplist first')
+    args = parser.parse_args()
+
+    if args.replace and not args.install:
+        parser.error('--replace only goes with --install')
+
+    if os.path.isdir(args.catalog):
+        stats = fromIndex(args.catalog)
+    else:
+        stats = fromSQL(args.catalog)
+
+    stoplist = stoplistFor(stats, args.fraction, args.max_df)
+    report(stats, stoplist, args.top)
+
+    if args.write:
+        with open(args.write, 'w') as stream:
+            for hashVal in sorted(stoplist):
+                stream.write('{}\n'.format(hashVal))
+
+    if args.install:
+        if not os.path.isdir(args.catalog):
+            parser.error('only segment indexes can have a stoplist installed')
+        for directory in indexDirs(args.catalog):
+            SegmentIndex.installStoplist(directory, stoplist, args.replace)
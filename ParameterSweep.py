@@ -0,0 +1,280 @@
+# ParameterSweep.py
+# Parameter sweep driver for the fingerprinter and matcher.
+# For every combination of the given parameter values, fingerprints the full
+# songs of a test set into a fresh sqlite database, matches each snippet
+# against it, and reports recall alongside fingerprint density, index size
+# and ingest/query times, so parameters can be picked for the hardware at
+# hand.
+import argparse
+import itertools
+import os
+import re
+import shutil
+import sqlite3
+import subprocess
+import tempfile
+import time
+import wave
+from glob import glob
+
+import HashStats
+import PrintMatcher
+
+FINGERPRINTER = './FingerPrinter'
+DBINIT = 'InitDatabase.sql'
+
+# Defaults, matching the defines at the top of Pipes.c.
+FFT_LEN = 4096
+SQUARESIZE = 5
+THRESHOLD = 12000000.0
+NEIGHBORHOOD = 8
+DELTA = 10000.0
+FANOUT = 10
+PEAKRATE = 0.0
+STREAMING = 0
+
+# Swept fingerprinting parameters and the FingerPrinter flag for each.
+# Neighborhood and delta are only read by the streaming peak finder, so they
+# only make a difference in rows with streaming on.
+FINGERPRINTFLAGS = [
+    ('fftlen', '-n'),
+    ('squaresize', '-q'),
+    ('threshold', '-t'),
+    ('neighborhood', '-N'),
+    ('delta', '-d'),
+    ('fanout', '-f'),
+    ('peakrate', '-p'),
+]
+
+# Swept on/off fingerprinting switches, given as 0 or 1, and their flags.
+FINGERPRINTSWITCHES = [
+    ('streaming', '-S'),
+]
+
+# Swept stoplist cutoffs: hashes in more than this share of the songs are
+# dropped from the index and the snippets (see HashStats.py). 0 turns it off.
+STOPFRACTION = 0.0
+
+# Swept matcher parameters. A topk of 0 tallies every song, otherwise the
+# matcher only looks for the best topk songs (see PrintMatcher.topMatches).
+MATCHERPARAMS = ['binsize', 'matchthreshold', 'topk', 'margin']
+
+SNIPPETPATTERN = re.compile(r'^(.*?)(\d+|snippet)\.wav$')
+FULLPATTERN = re.compile(r'^(.*)FULL\.wav$')
+
+############################################################################
+
+def wavSeconds(path):
+    """Length in seconds of the audio in a wav file."""
+    with wave.open(path, 'rb') as w:
+        return w.getnframes() / w.getframerate()
+
+def fingerprint(path, config, songId=0, fingerprinter=FINGERPRINTER):
+    """Run the fingerprinter on a wav file with the given configuration,
+    returning the csv lines it printed."""
+    command = [fingerprinter, path]
+    for param, flag in FINGERPRINTFLAGS:
+        command += [flag, str(config[param])]
+    for param, flag in FINGERPRINTSWITCHES:
+        if config[param]:
+            command.append(flag)
+    if songId:
+        command += ['-s', str(songId)]
+    output = subprocess.run(command, check=True, stdout=subprocess.PIPE,
+            universal_newlines=True).stdout
+    return output.splitlines()
+
+def buildIndex(fulls, config, dbPath, fingerprinter):
+    """Fingerprint the full songs into a fresh sqlite database.
+    Returns (ingest seconds, fingerprint count, seconds of audio)."""
+    conn = sqlite3.connect(dbPath)
+    with open(DBINIT, 'r') as init:
+        conn.executescript(init.read())
+    curs = conn.cursor()
+
+    fingerprints = 0
+    audio = 0.0
+    start = time.perf_counter()
+    for songId, (title, path) in enumerate(fulls, 1):
+        lines = fingerprint(path, config, songId, fingerprinter)
+        fingerprints += len(lines)
+        audio += wavSeconds(path)
+        curs.execute('insert into songs values (?, ?)', (songId, title))
+        curs.executemany(
+            'insert or ignore into fingerprints values (?, ?, ?)',
+            (tuple(line.split(',')) for line in lines))
+        conn.commit()
+    ingest = time.perf_counter() - start
+
+    conn.close()
+    return ingest, fingerprints, audio
+
+def fingerprintSnippets(snippets, config, fingerprinter):
+    """Fingerprint every snippet. Returns a list of (title, csv lines) pairs
+    and the total seconds spent fingerprinting."""
+    printed = []
+    start = time.perf_counter()
+    for title, path in snippets:
+        printed.append((title, fingerprint(path, config, 0, fingerprinter)))
+    return printed, time.perf_counter() - start
+
+def querySnippets(printed, titles, config, dbPath):
+    """Match every fingerprinted snippet against the database. A snippet
+    counts as recognized when its best match is the right song with at least
+    matchthreshold matches. Returns (recognized, total match seconds)."""
+    conn = sqlite3.connect(dbPath)
+    curs = conn.cursor()
+
+    recognized = 0
+    start = time.perf_counter()
+    for title, lines in printed:
+        if config['topk']:
+            ranked = PrintMatcher.topMatches(lines,
+                    lambda hashes: PrintMatcher.hashCountsFromDB(curs, hashes),
+                    lambda h: PrintMatcher.hashMatchesFromDB(curs, h),
+                    config['topk'], config['margin'], config['binsize'],
+                    config['matchthreshold'])
+        else:
+            matches = PrintMatcher.matchesInDB(lines, curs,
+                    config['binsize'])
+            ranked = sorted(matches.items(), key=lambda m: m[1],
+                    reverse=True)
+        if ranked:
+            best, count = ranked[0]
+            if titles[best] == title and count >= config['matchthreshold']:
+                recognized += 1
+    query = time.perf_counter() - start
+
+    conn.close()
+    return recognized, query
+
+def findTestSet(directory):
+    """Pair up the full songs and snippets of a test set by title."""
+    fulls = []
+    snippets = []
+    for path in sorted(glob(os.path.join(directory, '*.wav'))):
+        name = os.path.basename(path)
+        full = FULLPATTERN.match(name)
+        snippet = SNIPPETPATTERN.match(name)
+        if full:
+            fulls.append((full.group(1), path))
+        elif snippet:
+            snippets.append((snippet.group(1), path))
+    return fulls, snippets
+
+def stoplistIndex(dbPath, fraction, stoppedPath):
+    """Copy a database to stoppedPath without the hashes found in more than
+    fraction of its songs. Returns the stoplisted hashes."""
+    shutil.copyfile(dbPath, stoppedPath)
+    if not fraction:
+        return frozenset()
+    stoplist = HashStats.stoplistFor(HashStats.fromSQL(dbPath), fraction)
+    conn = sqlite3.connect(stoppedPath)
+    conn.executemany('DELETE FROM fingerprints WHERE hash = ?',
+            ((hashVal,) for hashVal in stoplist))
+    conn.commit()
+    conn.execute('VACUUM')
+    conn.close()
+    return frozenset(stoplist)
+
+def sweepFingerprintConfig(config, stopFractions, matcherConfigs, fulls,
+        snippets, fingerprinter):
+    """Build an index for one fingerprinting configuration, stoplist it at
+    each cutoff and query it with each matcher configuration. Yields
+    (stop fraction, matcher config, measurements) triples. Query times
+    include fingerprinting the snippet."""
+    titles = {songId: title for songId, (title, _) in enumerate(fulls, 1)}
+    with tempfile.TemporaryDirectory() as workdir:
+        dbPath = os.path.join(workdir, 'sweep.sqlite')
+        ingest, fingerprints, audio = buildIndex(fulls, config, dbPath,
+                fingerprinter)
+        printed, printing = fingerprintSnippets(snippets, config,
+                fingerprinter)
+
+        for stopFraction in stopFractions:
+            stoppedPath = os.path.join(workdir, 'stopped.sqlite')
+            stoplist = stoplistIndex(dbPath, stopFraction, stoppedPath)
+            indexBytes = os.path.getsize(stoppedPath)
+            stoppedPrints = [(title, [line for line in lines
+                    if int(line.split(',')[0]) not in stoplist])
+                    for title, lines in printed]
+            for matcherConfig in matcherConfigs:
+                recognized, query = querySnippets(stoppedPrints, titles,
+                        matcherConfig, stoppedPath)
+                queries = max(len(snippets), 1)
+                yield stopFraction, matcherConfig, {
+                    'recall': recognized / queries,
+                    'fpPerSec': fingerprints / audio if audio else 0.0,
+                    'bytesPerSong': indexBytes / len(fulls),
+                    'ingestSec': ingest,
+                    'queryMs': 1000 * (printing + query) / queries,
+                }
+
+############################################################################
+
+usageString = """Sweep fingerprinting and matching parameters over a test set
+of <title>FULL.wav songs and <title><n>.wav snippets. Each parameter takes a
+comma separated list of values and every combination is tried. Prints one
+tab separated row per configuration."""
+
+def valueList(kind):
+    """argparse type for comma separated lists of values."""
+    return lambda text: [kind(value) for value in text.split(',')]
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=usageString)
+    parser.add_argument('testSet', nargs='?', default='TestSet')
+    parser.add_argument('--fingerprinter', default=FINGERPRINTER)
+    parser.add_argument('--fftlen', type=valueList(int), default=[FFT_LEN])
+    parser.add_argument('--squaresize', type=valueList(int),
+            default=[SQUARESIZE])
+    parser.add_argument('--threshold', type=valueList(float),
+            default=[THRESHOLD])
+    parser.add_argument('--neighborhood', type=valueList(int),
+            default=[NEIGHBORHOOD])
+    parser.add_argument('--delta', type=valueList(float), default=[DELTA])
+    parser.add_argument('--fanout', type=valueList(int), default=[FANOUT])
+    parser.add_argument('--peakrate', type=valueList(float),
+            default=[PEAKRATE])
+    parser.add_argument('--streaming', type=valueList(int),
+            default=[STREAMING],
+            help='0 for the spectrogram peak finder, 1 for streaming')
+    parser.add_argument('--stopfraction', type=valueList(float),
+            default=[STOPFRACTION])
+    parser.add_argument('--binsize', type=valueList(int),
+            default=[PrintMatcher.BINSIZE])
+    parser.add_argument('--matchthreshold', type=valueList(int),
+            default=[PrintMatcher.MATCHTHRESHOLD])
+    parser.add_argument('--topk', type=valueList(int), default=[0])
+    parser.add_argument('--margin', type=valueList(int),
+            default=[PrintMatcher.MARGIN])
+    args = parser.parse_args()
+
+    fulls, snippets = findTestSet(args.testSet)
+    if not fulls:
+        parser.error('no *FULL.wav songs found in ' + args.testSet)
+
+    fingerprintNames = [param for param, _
+            in FINGERPRINTFLAGS + FINGERPRINTSWITCHES]
+    results = ['recall', 'fpPerSec', 'bytesPerSong', 'ingestSec', 'queryMs']
+    print('\t'.join(fingerprintNames + ['stopfraction'] + MATCHERPARAMS
+        + results))
+
+    matcherConfigs = [dict(zip(MATCHERPARAMS, values))
+            for values in itertools.product(
+                *(getattr(args, n) for n in MATCHERPARAMS))]
+
+    for values in itertools.product(
+            *(getattr(args, n) for n in fingerprintNames)):
+        config = dict(zip(fingerprintNames, values))
+        for stopFraction, matcherConfig, result in sweepFingerprintConfig(
+                config, args.stopfraction, matcherConfigs, fulls, snippets,
+                args.fingerprinter):
+            row = [str(value) for value in values] + [str(stopFraction)]
+            row += [str(matcherConfig[n]) for n in MATCHERPARAMS]
+            row += ['{:.3f}'.format(result['recall']),
+                    '{:.1f}'.format(result['fpPerSec']),
+                    '{:.0f}'.format(result['bytesPerSong']),
+                    '{:.2f}'.format(result['ingestSec']),
+                    '{:.1f}'.format(result['queryMs'])]
+            print('\t'.join(row), flush=True)
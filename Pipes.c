@@ -0,0 +1,764 @@
+/* Pipes.c - constructs acoustic fingerprints from sequences of samples.
+ *
+ * This is the fingerprinting library behind FingerPrinter (see Pipes.h).
+ * Everything it needs between calls lives in a PipesContext: buffers are
+ * grown when a longer clip comes along and otherwise reused, and nothing
+ * here prints or exits - errors go back to the caller as error codes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <complex.h>
+#include <math.h>
+#include "FourierTransform.h"
+#include "Pipes.h"
+
+/* Initial capacity of peak and fingerprint buffers. */
+#define I_CAP 8
+
+/* The defines below are the default fingerprinting parameters, which callers
+ * get from pipesDefaultParams and can override. The default sizes keep their
+ * own compiled paths where the inner loops depend on them. */
+
+/* Length of fourier transforms - how many samples are fed into fft. */
+#define FFT_LEN 4096
+
+/* Neighborhood on each side of a point which it must exceed to be a peak. */
+#define NEIGHBORHOOD 8
+
+/* Square size for experimental peak-finding algorithm.
+ * Larger keeps peak numbers manageable, but hurts frequency and time res */
+#define SQUARESIZE 5
+
+/* Threshold for peaks - peaks must have at least this magnitude. */
+#define THRESHOLD 12000000.0
+
+/* Delta threshold for peaks - peaks must be at least this much greater than
+ * their neighboring bins. */
+#define DELTA 10000.0
+
+/* Fanout factor for constellating peaks. For each peak, take the next FANOUT
+ * peaks and make a fingerprint out of each of those pairs. */
+#define FANOUT 10 /* TODO: increase this and adjust everything else to keep
+                    fingerprint numbers reasonable. */
+
+/* Target peaks per second of audio for adaptive peak selection. When this is
+ * nonzero the fixed THRESHOLD is ignored and the loudest candidates of each
+ * time slice are kept instead, so peak (and fingerprint) counts depend on
+ * the length of the audio rather than how loudly it was mastered. Zero keeps
+ * the fixed threshold. */
+#define PEAKRATE 0.0
+
+/* Minimum magnitude of a peak in adaptive mode. Quiet slices leave their
+ * budget unused rather than filling it with the loudest of nothing, so
+ * silent intros and outros don't add the same hashes to every song. A
+ * magnitude of 100000 is a sine of amplitude 50 at the default fft length,
+ * near the noise floor of 16-bit audio. */
+#define PEAKFLOOR 100000.0
+
+/* The spectrogram keeps magnitudes as 16-bit levels on a log scale, with
+ * this many levels per doubling of magnitude, so each level is about 0.03%
+ * louder than the one below and magnitudes up to 2^32 get distinct levels. */
+#define LOG_LEVELS 2048
+
+/* Spectrogram rows start on cache line boundaries. */
+#define ROW_ALIGN 64
+
+
+/* Version of the fingerprinting algorithm this library was built with. */
+int pipesVersion(void) {
+    return PIPES_VERSION;
+}
+
+/* Fill in a parameter structure with the compiled-in defaults. */
+PipesParams pipesDefaultParams(void) {
+    PipesParams result = { .fftLen = FFT_LEN,
+        .neighborhood = NEIGHBORHOOD,
+        .squareSize = SQUARESIZE,
+        .threshold = THRESHOLD,
+        .delta = DELTA,
+        .fanout = FANOUT,
+        .peakRate = PEAKRATE,
+        .streaming = 0 };
+    return result;
+}
+
+
+/**********************
+ * Peak Data Structures
+ *
+ * frequency-time peaks and dynamic vectors to hold a variable number of them.
+ */
+
+/* Structure for frequency-time peaks. */
+typedef struct _Peak {
+    int frequency;
+    int timeWindow;
+} Peak;
+
+/* Frequency-time peak vectors. */
+typedef struct _PeakVector {
+    size_t capacity;
+    int elements;
+    Peak * peaks;
+} PeakVector;
+
+/* A possible peak along with its magnitude, for adaptive peak selection. */
+typedef struct _Candidate {
+    Peak peak;
+    double magnitude;
+} Candidate;
+
+/* Everything fingerprinting needs, kept from one call to the next. The
+ * buffers of length fftLen are allocated with the context; the spectrogram,
+ * peaks and fingerprints grow to fit the longest clip seen so far. */
+struct _PipesContext {
+    PipesParams params;
+    FFTPlan * plan;
+
+    /* The fourier transforms of the current and the previous time window.
+     * Only the streaming peak finder needs the previous one. */
+    double complex * window;
+    double complex * previous;
+
+    /* The quantized log-magnitudes of every window's fourier transform, a
+     * row per window, for the spectrogram peak finder (see quantize). */
+    uint16_t * spectrogram;
+    size_t spectrogramCapacity;
+
+    /* The loudest level of each bin over one strip of squareSize windows,
+     * a spectrogram row long. */
+    uint16_t * stripMax;
+
+    /* Potential peaks of the previous window (streaming), candidates for
+     * adaptive selection and scratch space to rank them, fftLen of each. */
+    Peak * potentials;
+    Candidate * candidates;
+    double * scratch;
+
+    PeakVector peaks;
+
+    PipesPrint * prints;
+    size_t printCapacity;
+};
+
+/* Make sure a buffer holds at least needed elements of the given size,
+ * at least doubling it when it has to grow. Returns PIPES_ERR_MEMORY and
+ * leaves the buffer as it was if it can't. */
+static int reserve(void ** buffer, size_t * capacity, size_t needed,
+        size_t size) {
+
+    if (needed <= *capacity)
+        return PIPES_OK;
+
+    size_t grown = *capacity * 2 > needed ? *capacity * 2 : needed;
+    void * larger = realloc(*buffer, grown * size);
+    if (larger == NULL)
+        return PIPES_ERR_MEMORY;
+
+    *buffer = larger;
+    *capacity = grown;
+    return PIPES_OK;
+}
+
+/* Like reserve, for a buffer that starts on a ROW_ALIGN boundary. Its
+ * contents are not kept when it grows. */
+static int reserveAligned(void ** buffer, size_t * capacity, size_t needed,
+        size_t size) {
+
+    if (needed <= *capacity)
+        return PIPES_OK;
+
+    size_t grown = *capacity * 2 > needed ? *capacity * 2 : needed;
+    void * larger;
+    if (posix_memalign(&larger, ROW_ALIGN, grown * size))
+        return PIPES_ERR_MEMORY;
+
+    free(*buffer);
+    *buffer = larger;
+    *capacity = grown;
+    return PIPES_OK;
+}
+
+/* Append a peak to a peak vector, potentially resizing it. */
+static int vectorAppend(PeakVector * vect, Peak pk) {
+    if (reserve((void **) &vect->peaks, &vect->capacity,
+                (size_t) vect->elements + 1, sizeof(Peak)))
+        return PIPES_ERR_MEMORY;
+
+    vect->peaks[vect->elements] = pk;
+    vect->elements++;
+    return PIPES_OK;
+}
+
+/* Number of levels from one spectrogram row to the next for fourier
+ * transforms of length m: the m/2 + 1 bins kept, padded so that every row
+ * starts on a ROW_ALIGN boundary. */
+static int rowStride(int m) {
+    int bins = m / 2 + 1;
+    return (bins * sizeof(uint16_t) + ROW_ALIGN - 1) / ROW_ALIGN
+        * (ROW_ALIGN / sizeof(uint16_t));
+}
+
+/* Sets up a context for fingerprinting with the given parameters. Returns
+ * PIPES_ERR_PARAMS unless the fft length is a power of two of at least 2 and
+ * the sizes and fanout are positive. */
+int pipesNewContext(PipesContext ** context, const PipesParams * params) {
+    int m = params->fftLen;
+
+    if (m < 2 || !isPowerofTwo(m) || params->squareSize < 1
+            || params->fanout < 1 || params->neighborhood < 1)
+        return PIPES_ERR_PARAMS;
+
+    PipesContext * new = calloc(1, sizeof(PipesContext));
+    if (new == NULL)
+        return PIPES_ERR_MEMORY;
+
+    new->params = *params;
+    new->plan = newFFTPlan(m);
+    new->window = malloc(sizeof(double complex) * m);
+    new->previous = malloc(sizeof(double complex) * m);
+    new->potentials = malloc(sizeof(Peak) * m);
+    new->candidates = malloc(sizeof(Candidate) * m);
+    new->scratch = malloc(sizeof(double) * m);
+    new->stripMax = malloc(sizeof(uint16_t) * rowStride(m));
+    new->peaks.capacity = I_CAP;
+    new->peaks.peaks = malloc(sizeof(Peak) * I_CAP);
+    new->printCapacity = I_CAP;
+    new->prints = malloc(sizeof(PipesPrint) * I_CAP);
+
+    if (new->plan == NULL || new->window == NULL || new->previous == NULL
+            || new->potentials == NULL || new->candidates == NULL
+            || new->scratch == NULL || new->stripMax == NULL
+            || new->peaks.peaks == NULL
+            || new->prints == NULL) {
+        pipesFreeContext(new);
+        return PIPES_ERR_MEMORY;
+    }
+
+    *context = new;
+    return PIPES_OK;
+}
+
+/* Free a context and all of its buffers. */
+void pipesFreeContext(PipesContext * context) {
+    if (context == NULL)
+        return;
+    freeFFTPlan(context->plan);
+    free(context->window);
+    free(context->previous);
+    free(context->spectrogram);
+    free(context->stripMax);
+    free(context->potentials);
+    free(context->candidates);
+    free(context->scratch);
+    free(context->peaks.peaks);
+    free(context->prints);
+    free(context);
+}
+
+/* Number of peaks the last call to pipesFingerprint found. */
+int pipesLastPeakCount(const PipesContext * context) {
+    return context->peaks.elements;
+}
+
+/* A short description of an error code. */
+const char * pipesError(int error) {
+    switch (error) {
+        case PIPES_OK:
+            return "no error";
+        case PIPES_ERR_MEMORY:
+            return "out of memory";
+        case PIPES_ERR_PARAMS:
+            return "fft length must be a power of two and sizes positive";
+        case PIPES_ERR_INPUT:
+            return "invalid samples";
+        case PIPES_ERR_SHORT:
+            return "not enough samples for one fourier transform";
+        case PIPES_ERR_RATE:
+            return "adaptive peaks need the sample rate";
+        default:
+            return "unknown error";
+    }
+}
+
+/* Partially reorder n values so that the one at index would be there if they
+ * were sorted largest first, and return it. This is Hoare's quickselect, in
+ * place and in linear time on average, so adaptive peak selection never
+ * allocates (qsort may). */
+static double selectLargest(double * values, int n, int index) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi) {
+        double pivot = values[lo + (hi - lo) / 2];
+        int i = lo;
+        int j = hi;
+        while (i <= j) {
+            while (values[i] > pivot)
+                i++;
+            while (values[j] < pivot)
+                j--;
+            if (i <= j) {
+                double temp = values[i];
+                values[i++] = values[j];
+                values[j--] = temp;
+            }
+        }
+        if (index <= j)
+            hi = j;
+        else if (index >= i)
+            lo = i;
+        else
+            break;
+    }
+    return values[index];
+}
+
+/* How many peaks the next adaptive time slice may keep, given the target
+ * number of peaks per slice. The fractional part carries over in budget so
+ * the long-run rate matches the target even when slices are short. */
+static int sliceBudget(double * budget, double peaksPerSlice) {
+    *budget += peaksPerSlice;
+    int k = (int) *budget;
+    *budget -= k;
+    return k;
+}
+
+/* Append the k loudest of n candidates to a peak vector, keeping them in the
+ * order they were found in. scratch must hold at least n doubles. */
+static int appendLoudest(PeakVector * peaks, Candidate * candidates, int n,
+        int k, double * scratch) {
+
+    if (k <= 0 || n == 0)
+        return PIPES_OK;
+
+    /* Find the magnitude of the k-th loudest candidate. */
+    for (int i = 0; i < n; i++)
+        scratch[i] = candidates[i].magnitude;
+    double cutoff = selectLargest(scratch, n, (k < n ? k : n) - 1);
+
+    /* Everything strictly louder makes it, ties fill up what's left. */
+    int louder = 0;
+    for (int i = 0; i < n; i++)
+        louder += candidates[i].magnitude > cutoff;
+    int ties = k - louder;
+
+    for (int i = 0; i < n; i++) {
+        int keep = candidates[i].magnitude > cutoff
+            || (candidates[i].magnitude == cutoff && ties-- > 0);
+        if (keep && vectorAppend(peaks, candidates[i].peak))
+            return PIPES_ERR_MEMORY;
+    }
+    return PIPES_OK;
+}
+
+/* Copy count samples of the first channel, starting at frame start, into a
+ * fourier transform input. Samples are taken as unsigned 16-bit values, as
+ * WAVReading always read them, so fingerprints match earlier ones. */
+static void loadSamples(double complex * input, const int16_t * samples,
+        int start, int count, int channels) {
+    for (int i = 0; i < count; i++)
+        input[i] = (uint16_t) samples[(size_t) (start + i) * channels];
+}
+
+/* Load time window k of m samples into a fourier transform input. Every
+ * window after the first pairs the m/2 samples that follow the previous
+ * window with the second half of the very first window, not with the half
+ * before them: that is how both peak finders have always refilled their
+ * input buffer, and every stored fingerprint depends on it. The spectrogram
+ * finder put the new half first and the streaming one put it last, which
+ * only differs in the sign of odd bins. */
+static void loadWindow(double complex * input, const int16_t * samples,
+        int k, int m, int channels, int newHalfLast) {
+    if (k == 0) {
+        loadSamples(input, samples, 0, m, channels);
+        return;
+    }
+
+    int newHalf = newHalfLast ? m / 2 : 0;
+    loadSamples(input + newHalf, samples, (k + 1) * (m / 2), m / 2, channels);
+    loadSamples(input + (m / 2 - newHalf), samples, m / 2, m / 2, channels);
+}
+
+/* Quantize the power (squared magnitude) of a fourier coefficient to a
+ * spectrogram level: 0 below a magnitude of 1, then LOG_LEVELS levels per
+ * doubling of magnitude. Louder never gets a lower level, so comparisons of
+ * levels agree with comparisons of magnitudes except within a level. */
+static inline uint16_t quantize(double power) {
+    if (power < 1.0)
+        return 0;
+    double level = (LOG_LEVELS / 2) * log2(power) + 1.0;
+    return level < UINT16_MAX ? (uint16_t) level : UINT16_MAX;
+}
+
+/* Find the loudest level of each bin over a strip of size spectrogram rows,
+ * stride apart, into stripMax. This takes the maximum of whole rows element
+ * by element, which gcc vectorizes, so each square's maximum is then a
+ * look at size values of stripMax. */
+static inline __attribute__((always_inline)) void findStripMax(
+        const uint16_t * restrict strip, int stride, int size,
+        uint16_t * restrict stripMax) {
+
+    for (int b = 0; b < stride; b++)
+        stripMax[b] = strip[b];
+    for (int x = 1; x < size; x++) {
+        const uint16_t * restrict row = strip + (size_t) x * stride;
+        for (int b = 0; b < stride; b++)
+            stripMax[b] = row[b] > stripMax[b] ? row[b] : stripMax[b];
+    }
+}
+
+/* The loudest level of the square starting at bin j of a strip. */
+static inline __attribute__((always_inline)) int squareMax(
+        const uint16_t * stripMax, int j, int size) {
+    int level = 0;
+    for (int y = 0; y < size; y++)
+        level = stripMax[j+y] > level ? stripMax[j+y] : level;
+    return level;
+}
+
+/* The first point of the square starting at bin j of the strip starting at
+ * window i with the given level, scanning window by window. That is the
+ * point a running maximum over the square would stop at. */
+static inline __attribute__((always_inline)) Peak findLevel(
+        const uint16_t * strip, int stride, int i, int j, int size,
+        int level) {
+    Peak p = { .frequency = j, .timeWindow = i };
+    for (int x = 0; x < size; x++) {
+        const uint16_t * row = strip + (size_t) x * stride;
+        for (int y = 0; y < size; y++) {
+            if (row[j+y] == level) {
+                p.frequency = j + y;
+                p.timeWindow = i + x;
+                return p;
+            }
+        }
+    }
+    return p;
+}
+
+/* Find the loudest point above a threshold level in each size x size square
+ * of the spectrogram, appending it to the peak vector, which must have room
+ * for a peak per square. Rows of the spectrogram hold bins levels, stride
+ * apart. stripMax holds a row.
+ *
+ * Each strip of size windows first gets its maximum per bin (findStripMax,
+ * vectorized), which gives every square's maximum; only squares louder than
+ * the threshold are scanned again for where it is.
+ *
+ * Forced inline, so the call with the constant SQUARESIZE gets its own copy
+ * with fixed inner loop bounds, which the optimizer unrolls; other sizes
+ * share the generic copy. */
+static inline __attribute__((always_inline)) void squarePeaks(
+        const uint16_t * spectrogram, int windows, int bins, int stride,
+        int size, int threshold, uint16_t * stripMax, PeakVector * peaks) {
+
+    for (int i = 0; i < windows - size; i += size) {
+        const uint16_t * strip = spectrogram + (size_t) i * stride;
+        findStripMax(strip, stride, size, stripMax);
+        for (int j = 0; j < bins - size; j += size) {
+            int level = squareMax(stripMax, j, size);
+            if (level > threshold)
+                peaks->peaks[peaks->elements++] =
+                    findLevel(strip, stride, i, j, size, level);
+        }
+    }
+}
+
+/* Adaptive version of squarePeaks. Instead of a fixed threshold, takes the
+ * loudest square maxima in each row of squares (one time slice of size
+ * windows), keeping peaksPerSlice of them on average. Squares no louder
+ * than the floor level are never candidates. candidates and scratch must
+ * hold a square per row. */
+static void squarePeaksAdaptive(const uint16_t * spectrogram, int windows,
+        int bins, int stride, int size, double peaksPerSlice,
+        int floorLevel, Candidate * candidates, double * scratch,
+        uint16_t * stripMax, PeakVector * peaks) {
+
+    double budget = 0.0;
+    for (int i = 0; i < windows - size; i += size) {
+        const uint16_t * strip = spectrogram + (size_t) i * stride;
+        findStripMax(strip, stride, size, stripMax);
+        int n = 0;
+        for (int j = 0; j < bins - size; j += size) {
+            int level = squareMax(stripMax, j, size);
+            if (level > floorLevel) {
+                Candidate best = { .magnitude = level,
+                    .peak = findLevel(strip, stride, i, j, size, level) };
+                candidates[n++] = best;
+            }
+        }
+
+        /* The vector has room for every square, so this can't fail. */
+        appendLoudest(peaks, candidates, n,
+                sliceBudget(&budget, peaksPerSlice), scratch);
+    }
+}
+
+/* Find peaks over the whole spectrogram, which is held in the context.
+ *
+ * The input is real, so the upper half of each fourier transform mirrors
+ * the lower half and only bins 0 to m/2 are kept, as quantized levels
+ * rather than complex numbers: 2 bytes a bin instead of 32 for both halves.
+ *
+ * This works by breaking up the spectrogram into squares of a given
+ * side length, finding the max in each of those squares, and cutting off
+ * based on a threshold. */
+static int spectrogramPeaks(PipesContext * context, const int16_t * samples,
+        int windows, int channels, int sampleRate) {
+
+    PipesParams * params = &context->params;
+    int m = params->fftLen;
+    int size = params->squareSize;
+    int bins = m / 2 + 1;
+    int stride = rowStride(m);
+
+    /* First, compute the spectrogram, a window at a time. */
+    if (reserveAligned((void **) &context->spectrogram,
+                &context->spectrogramCapacity, (size_t) windows * stride,
+                sizeof(uint16_t)))
+        return PIPES_ERR_MEMORY;
+
+    double complex * fft = context->window;
+    for (int k = 0; k < windows; k++) {
+        uint16_t * row = context->spectrogram + (size_t) k * stride;
+        loadWindow(fft, samples, k, m, channels, 0);
+        plannedFourierTransform(context->plan, fft);
+        for (int b = 0; b < bins; b++)
+            row[b] = quantize(creal(fft[b]) * creal(fft[b])
+                    + cimag(fft[b]) * cimag(fft[b]));
+        for (int b = bins; b < stride; b++)
+            row[b] = 0;
+    }
+
+    /* Make room for one peak per square up front, so the scans below don't
+     * have to check for running out. */
+    size_t squares = (size_t) ((windows + size - 1) / size)
+        * ((bins + size - 1) / size);
+    if (reserve((void **) &context->peaks.peaks, &context->peaks.capacity,
+                squares, sizeof(Peak)))
+        return PIPES_ERR_MEMORY;
+
+    /* Now, iterate over the spectrogram's square regions, collecting peaks.
+     * For now, very simplistic brute-force algorithm. */
+    if (params->peakRate > 0) {
+        /* Time windows overlap by half, so each one advances m/2 samples. */
+        double sliceSeconds = (double) size * (m / 2) / sampleRate;
+        squarePeaksAdaptive(context->spectrogram, windows, bins, stride,
+                size, params->peakRate * sliceSeconds,
+                quantize(PEAKFLOOR * PEAKFLOOR), context->candidates,
+                context->scratch, context->stripMax, &context->peaks);
+    }
+    else {
+        int threshold = params->threshold > 0
+            ? quantize(params->threshold * params->threshold) : 0;
+        if (size == SQUARESIZE)
+            squarePeaks(context->spectrogram, windows, bins, stride,
+                    SQUARESIZE, threshold, context->stripMax,
+                    &context->peaks);
+        else
+            squarePeaks(context->spectrogram, windows, bins, stride, size,
+                    threshold, context->stripMax, &context->peaks);
+    }
+
+    return PIPES_OK;
+}
+
+/* Find peaks one time window at a time, keeping only two windows' fourier
+ * transforms.
+ *
+ * In adaptive mode (a nonzero peak rate) potential peaks only need to clear
+ * PEAKFLOOR rather than the threshold; instead only the loudest confirmed
+ * peaks of each time window are kept, at the target rate. Adaptive mode
+ * only looks at bins 0 to m/2, since the input is real and the rest mirror
+ * them, so none of the budget goes to mirror copies. The fixed threshold
+ * mode keeps scanning every bin, so its fingerprints stay the same. */
+static int streamingPeaks(PipesContext * context, const int16_t * samples,
+        int windows, int channels, int sampleRate) {
+
+    PipesParams * params = &context->params;
+    int m = params->fftLen;
+    int neighborhood = params->neighborhood;
+    double delta = params->delta;
+    int adaptive = params->peakRate > 0;
+    double peaksPerWindow = adaptive
+        ? params->peakRate * (m / 2) / sampleRate : 0.0;
+    double budget = 0.0;
+    int end = adaptive && m / 2 + 1 < m - neighborhood
+        ? m / 2 + 1 : m - neighborhood;
+    PeakVector * result = &context->peaks;
+    Peak * potentials = context->potentials;
+    Candidate * confirmed = context->candidates;
+
+    double complex * oldFFTValues = context->previous;
+    double complex * nextFFTValues = context->window;
+    loadWindow(oldFFTValues, samples, 0, m, channels, 1);
+    plannedFourierTransform(context->plan, oldFFTValues);
+
+    int potentialCount = 0;
+    int t = 0;
+
+    /* Go through the rest of the windows, collecting peaks. */
+    for (int k = 1; k < windows; k++) {
+        loadWindow(nextFFTValues, samples, k, m, channels, 1);
+        plannedFourierTransform(context->plan, nextFFTValues);
+
+        /* Check if we confirmed any potential peaks. */
+        int n = 0;
+        for (int i = 0; i < potentialCount; i++) {
+            Peak poss = potentials[i];
+            double mag = cabs(oldFFTValues[poss.frequency]);
+            if (mag > cabs(nextFFTValues[poss.frequency])) {
+                /* peak confirmed. */
+                if (adaptive) {
+                    Candidate c = { .peak = poss, .magnitude = mag };
+                    confirmed[n++] = c;
+                }
+                else if (vectorAppend(result, poss))
+                    return PIPES_ERR_MEMORY;
+            }
+        }
+
+        if (adaptive && appendLoudest(result, confirmed, n,
+                    sliceBudget(&budget, peaksPerWindow), context->scratch))
+            return PIPES_ERR_MEMORY;
+
+        potentialCount = 0;
+        for (int i = neighborhood; i < end; i++) {
+            double mag = cabs(nextFFTValues[i]);
+            int isPeak = 1;
+            for (int j = 1; j <= neighborhood; j++) {
+                isPeak = isPeak && mag > cabs(nextFFTValues[i+j]) + delta;
+                isPeak = isPeak && mag > cabs(nextFFTValues[i-j]) + delta;
+            }
+            isPeak = isPeak && mag > cabs(oldFFTValues[i]) + delta;
+            isPeak = isPeak
+                && mag > (adaptive ? PEAKFLOOR : params->threshold);
+            if (isPeak) {
+                /* found a potential peak! */
+                Peak poss = { .frequency = i, .timeWindow = t };
+                potentials[potentialCount++] = poss;
+            }
+        }
+
+        /* The new fourier transform becomes the old one. */
+        double complex * swap = oldFFTValues;
+        oldFFTValues = nextFFTValues;
+        nextFFTValues = swap;
+
+        t++;
+    }
+
+    return PIPES_OK;
+}
+
+/* Structure of a fingerprint. */
+typedef struct _Fingerprint {
+    /* The time window of the first peak that makes up this fingerprint. */
+    int timeWindow;
+
+    /* The values that actually make up the hash of these fingerprints. */
+    /* The frequencies of the two peaks in the fingerprint. */
+    int frequency1;
+    int frequency2;
+    /* The time difference between the two peaks. */
+    int timeDifference;
+} Fingerprint;
+
+/* Package a pair of peaks into a fingerprint. */
+static Fingerprint fromPeaks(Peak p1, Peak p2) {
+    Fingerprint result = { .timeWindow = p1.timeWindow,
+        .frequency1 = p1.frequency,
+        .frequency2 = p2.frequency,
+        .timeDifference = p2.timeWindow - p1.timeWindow };
+    return result;
+}
+
+/* Hash a given fingerprint's two frequencies as well as time delta together.
+ *
+ * Currently, the hash function naively assumes that each of these three
+ * values will be less than 16 bits long to get a no-collision hash by just
+ * concatenating the bits together. Later we can make a better space/collisions
+ * tradeoff with a real hash function.
+ */
+static unsigned int basicHash(Fingerprint fp) {
+    unsigned int hash = fp.frequency1;
+    hash = (hash << 16) + fp.frequency2;
+    hash = (hash << 16) + fp.timeDifference;
+    return hash;
+}
+
+/* Fingerprint all of the peaks in the context, pairing each peak with the
+ * next fanout peaks, and hash them into the context's fingerprint buffer.
+ * Returns the number of fingerprints through count. */
+static int fingerprintPeaks(PipesContext * context, int * count) {
+    PeakVector * pv = &context->peaks;
+    int fanout = context->params.fanout;
+
+    /* Every peak pairs with the next fanout peaks, or as many as are left. */
+    size_t total = 0;
+    for (int i = 0; i < pv->elements; i++)
+        total += pv->elements - i < fanout ? pv->elements - i : fanout;
+
+    if (reserve((void **) &context->prints, &context->printCapacity, total,
+                sizeof(PipesPrint)))
+        return PIPES_ERR_MEMORY;
+
+    int n = 0;
+    for (int i = 0; i < pv->elements; i++) {
+        for (int j = 0; j < fanout && i + j < pv->elements; j++) {
+            Fingerprint fp = fromPeaks(pv->peaks[i], pv->peaks[i+j]);
+            context->prints[n].hash = basicHash(fp);
+            context->prints[n].timeWindow = fp.timeWindow;
+            n++;
+        }
+    }
+
+    *count = n;
+    return PIPES_OK;
+}
+
+/* Fingerprint frames frames of interleaved 16-bit PCM samples with the given
+ * number of channels. Only the first channel is used. The sample rate is only
+ * needed for adaptive peak selection.
+ *
+ * On success, points prints at count fingerprints, which belong to the
+ * context and stay valid until it is next used or freed, and returns
+ * PIPES_OK. Otherwise returns an error code. */
+int pipesFingerprint(PipesContext * context, const int16_t * samples,
+        int frames, int channels, int sampleRate,
+        const PipesPrint ** prints, int * count) {
+
+    PipesParams * params = &context->params;
+    int m = params->fftLen;
+
+    context->peaks.elements = 0;
+
+    if (samples == NULL || frames < 0 || channels < 1)
+        return PIPES_ERR_INPUT;
+
+    if (params->peakRate > 0 && sampleRate <= 0)
+        return PIPES_ERR_RATE;
+
+    if (frames < m)
+        return PIPES_ERR_SHORT;
+
+    /* Windows overlap by half: one starts every m/2 samples. */
+    int windows = (frames / (m / 2)) - 1;
+
+    int error;
+    if (params->streaming)
+        error = streamingPeaks(context, samples, windows, channels,
+                sampleRate);
+    else
+        error = spectrogramPeaks(context, samples, windows, channels,
+                sampleRate);
+
+    if (error == PIPES_OK)
+        error = fingerprintPeaks(context, count);
+
+    if (error == PIPES_OK)
+        *prints = context->prints;
+    return error;
+}
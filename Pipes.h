@@ -0,0 +1,99 @@
+/* Pipes.h - the fingerprinting library.
+ *
+ * Fingerprints in-memory PCM samples. A context holds the parameters, the
+ * fourier transform tables and every buffer fingerprinting needs, and keeps
+ * them between calls, so a process can fingerprint clip after clip without
+ * allocating once its buffers have grown to the longest clip. Functions
+ * return error codes instead of exiting. A context must only be used by one
+ * thread at a time; use one context per thread.
+ *
+ *     PipesContext * context;
+ *     PipesParams params = pipesDefaultParams();
+ *     if (pipesNewContext(&context, &params) == PIPES_OK) {
+ *         const PipesPrint * prints;
+ *         int count;
+ *         int error = pipesFingerprint(context, samples, frames, channels,
+ *                 sampleRate, &prints, &count);
+ *         ...
+ *         pipesFreeContext(context);
+ *     }
+ */
+
+#ifndef PIPES_H
+#define PIPES_H
+
+#include <stdint.h>
+
+/* The library is built with hidden symbols, so only the functions marked
+ * PIPES_API are visible to programs using it; its fourier transforms and
+ * other helpers can't clash with theirs. */
+#define PIPES_API __attribute__((visibility("default")))
+
+/* Version of the fingerprinting algorithm. It goes up whenever a change to
+ * the library changes the fingerprints produced for the same samples and
+ * parameters, so callers that store fingerprints, like FingerPrinter's cache,
+ * can tell stale ones apart. pipesVersion gives the version of the library
+ * actually linked, which may differ from this header's for libpipes.so. */
+#define PIPES_VERSION 4
+
+/* Error codes. */
+#define PIPES_OK 0
+/* Out of memory. The context is still usable. */
+#define PIPES_ERR_MEMORY 1
+/* Parameters out of range, see pipesNewContext. */
+#define PIPES_ERR_PARAMS 2
+/* Bad samples: a NULL buffer, a negative length or no channels. */
+#define PIPES_ERR_INPUT 3
+/* Fewer samples than one fourier transform needs. */
+#define PIPES_ERR_SHORT 4
+/* Adaptive peak selection without a sample rate. */
+#define PIPES_ERR_RATE 5
+
+/* Fingerprinting parameters. */
+typedef struct _PipesParams {
+    /* Length of fourier transforms, a power of two. */
+    int fftLen;
+    /* Neighborhood size for the streaming peak finder. */
+    int neighborhood;
+    /* Side length of the peak-finding squares. */
+    int squareSize;
+    /* Minimum magnitude of a peak. */
+    double threshold;
+    /* How much a peak must exceed its neighbors by (streaming only). */
+    double delta;
+    /* How many following peaks each peak is paired with. */
+    int fanout;
+    /* Peaks per second of audio for adaptive peak selection, which replaces
+     * the threshold. 0 turns it off. */
+    double peakRate;
+    /* Nonzero to find peaks window by window instead of over the whole
+     * spectrogram. Slower, but uses far less memory on long clips. */
+    int streaming;
+} PipesParams;
+
+/* A fingerprint's hash and the time window of its first peak. */
+typedef struct _PipesPrint {
+    uint32_t hash;
+    uint32_t timeWindow;
+} PipesPrint;
+
+typedef struct _PipesContext PipesContext;
+
+PIPES_API int pipesVersion(void);
+
+PIPES_API PipesParams pipesDefaultParams(void);
+
+PIPES_API int pipesNewContext(PipesContext ** context,
+        const PipesParams * params);
+
+PIPES_API void pipesFreeContext(PipesContext * context);
+
+PIPES_API int pipesFingerprint(PipesContext * context, const int16_t * samples,
+        int frames, int channels, int sampleRate,
+        const PipesPrint ** prints, int * count);
+
+PIPES_API int pipesLastPeakCount(const PipesContext * context);
+
+PIPES_API const char * pipesError(int error);
+
+#endif
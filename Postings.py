@@ -0,0 +1,246 @@
+# Postings.py
+# Compressed posting lists for fingerprint segments.
+# A segment file groups all postings of a hash together, sorted by
+# (songId, offset), and stores them delta-encoded as byte-aligned varints:
+#
+#   header    magic, block size, block count, hash count, posting count,
+#             byte offset of the song table
+#   skip list first hash of every block (uint32), then the byte offset of
+#             every block (uint64)
+#   blocks    BLOCKSIZE entries each. An entry is varint(hash - previous
+#             hash), varint(postings), varint(posting bytes), then for each
+#             posting varint(songId - previous songId) and varint(offset -
+#             previous offset) when the song is the same, or varint(offset)
+#             when it changes.
+#   songs     json list of [songId, title] pairs
+#
+# A lookup binary searches the skip list and walks at most one block, hopping
+# over other entries' postings by their byte length. Postings are decoded
+# straight into the matcher's delta histograms without building rows.
+import json
+import mmap
+import struct
+from array import array
+from bisect import bisect_right
+
+MAGIC = b'PIPESEG1'
+HEADER = struct.Struct('<8sIIIQQ')
+
+# Hash entries per skip list block. Smaller blocks mean shorter walks per
+# lookup but a bigger skip list.
+BLOCKSIZE = 32
+
+############################################################################
+### Encoding
+###
+
+def putVarint(out, value):
+    """Append the LEB128 varint encoding of a non-negative int to out."""
+    while value >= 0x80:
+        out.append((value & 0x7f) | 0x80)
+        value >>= 7
+    out.append(value)
+
+def encodePostings(postings):
+    """Delta-encode a sorted list of (songId, offset) postings."""
+    out = bytearray()
+    prevSong = 0
+    prevOffset = 0
+    for songId, offset in postings:
+        putVarint(out, songId - prevSong)
+        if songId == prevSong:
+            putVarint(out, offset - prevOffset)
+        else:
+            putVarint(out, offset)
+        prevSong = songId
+        prevOffset = offset
+    return out
+
+def writeSegmentFile(path, songs, rows):
+    """Write a segment file from (songId, title) pairs and (songId, hash,
+    offset) rows. Duplicate rows are dropped. Returns the posting count."""
+    byHash = {}
+    for songId, hashVal, offset in rows:
+        if not 0 <= hashVal < 2 ** 32 or songId < 0 or offset < 0:
+            raise ValueError('bad fingerprint row {}'.format(
+                (songId, hashVal, offset)))
+        byHash.setdefault(hashVal, set()).add((songId, offset))
+
+    hashes = sorted(byHash)
+    firstHashes = array('I')
+    blockOffsets = array('Q')
+    blocks = bytearray()
+    postingCount = 0
+    prevHash = 0
+    for i, hashVal in enumerate(hashes):
+        if i % BLOCKSIZE == 0:
+            firstHashes.append(hashVal)
+            blockOffsets.append(len(blocks))
+            prevHash = hashVal
+        postings = sorted(byHash[hashVal])
+        encoded = encodePostings(postings)
+        putVarint(blocks, hashVal - prevHash)
+        putVarint(blocks, len(postings))
+        putVarint(blocks, len(encoded))
+        blocks += encoded
+        prevHash = hashVal
+        postingCount += len(postings)
+
+    # Block offsets are stored relative to the file, not the block data.
+    base = HEADER.size + len(firstHashes) * (4 + 8)
+    blockOffsets = array('Q', (base + o for o in blockOffsets))
+    songTable = json.dumps(sorted(songs)).encode()
+
+    with open(path, 'wb') as stream:
+        stream.write(HEADER.pack(MAGIC, BLOCKSIZE, len(firstHashes),
+            len(hashes), postingCount, base + len(blocks)))
+        stream.write(firstHashes.tobytes())
+        stream.write(blockOffsets.tobytes())
+        stream.write(blocks)
+        stream.write(songTable)
+
+    return postingCount
+
+############################################################################
+### Decoding
+###
+
+def readVarint(data, pos):
+    """Decode the varint at pos. Returns (value, position after it)."""
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return value, pos
+        shift += 7
+
+class Segment:
+    """A read-only, memory mapped segment file."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as stream:
+            self.data = mmap.mmap(stream.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, self.blockSize, blocks, self.hashCount, self.postingCount,
+                self.blocksEnd) = HEADER.unpack_from(self.data, 0)
+        if magic != MAGIC:
+            raise ValueError('{} is not a segment file'.format(path))
+
+        skip = HEADER.size
+        self.firstHashes = array('I')
+        self.firstHashes.frombytes(self.data[skip:skip + 4 * blocks])
+        skip += 4 * blocks
+        self.blockOffsets = array('Q')
+        self.blockOffsets.frombytes(self.data[skip:skip + 8 * blocks])
+        self.songTable = [tuple(song) for song in
+                json.loads(self.data[self.blocksEnd:].decode())]
+
+    def close(self):
+        self.data.close()
+
+    def find(self, hashVal):
+        """Locate the postings of a hash. Returns (count, start, end) byte
+        positions of its encoded postings, or None if it isn't here."""
+        block = bisect_right(self.firstHashes, hashVal) - 1
+        if block < 0:
+            return None
+        data = self.data
+        pos = self.blockOffsets[block]
+        current = self.firstHashes[block]
+        for _ in range(self.blockSize):
+            if pos >= self.blocksEnd:
+                return None
+            delta, pos = readVarint(data, pos)
+            count, pos = readVarint(data, pos)
+            length, pos = readVarint(data, pos)
+            current += delta
+            if current == hashVal:
+                return count, pos, pos + length
+            if current > hashVal:
+                return None
+            pos += length
+        return None
+
+    def postingCountOf(self, hashVal):
+        """Number of postings a hash has in this segment."""
+        found = self.find(hashVal)
+        return found[0] if found else 0
+
+    def decode(self, start, end):
+        """Generate the (songId, offset) postings encoded between two byte
+        positions."""
+        data = self.data
+        pos = start
+        songId = 0
+        offset = 0
+        while pos < end:
+            value = 0
+            shift = 0
+            while True:
+                byte = data[pos]
+                pos += 1
+                value |= (byte & 0x7f) << shift
+                if byte < 0x80:
+                    break
+                shift += 7
+            if value:
+                songId += value
+                offset = 0
+            value = 0
+            shift = 0
+            while True:
+                byte = data[pos]
+                pos += 1
+                value |= (byte & 0x7f) << shift
+                if byte < 0x80:
+                    break
+                shift += 7
+            offset += value
+            yield songId, offset
+
+    def hashMatches(self, hashVal):
+        """(songId, offset) postings of a hash."""
+        found = self.find(hashVal)
+        if found is None:
+            return []
+        return list(self.decode(found[1], found[2]))
+
+    def tally(self, hashVal, offset, matches, newBins, skip=frozenset()):
+        """Add the time deltas between a snippet fingerprint and every
+        posting of its hash straight into matches, a dict of songId:
+        DeltaBin, making new bins with newBins(). Songs in skip are left
+        out."""
+        found = self.find(hashVal)
+        if found is None:
+            return
+        for songId, offset2 in self.decode(found[1], found[2]):
+            if songId in skip:
+                continue
+            bins = matches.get(songId)
+            if bins is None:
+                bins = matches[songId] = newBins()
+            bins.add(offset2 - offset)
+
+    def directory(self):
+        """Generate (hash, posting count, start, end) for every hash in the
+        segment, where start and end are the byte positions of its encoded
+        postings."""
+        data = self.data
+        pos = HEADER.size + len(self.firstHashes) * (4 + 8)
+        for i in range(self.hashCount):
+            if i % self.blockSize == 0:
+                current = self.firstHashes[i // self.blockSize]
+            delta, pos = readVarint(data, pos)
+            count, pos = readVarint(data, pos)
+            length, pos = readVarint(data, pos)
+            current += delta
+            yield current, count, pos, pos + length
+            pos += length
+
+    def entries(self):
+        """Generate every (hash, songId, offset) posting in the segment."""
+        for hashVal, _, start, end in self.directory():
+            for songId, offset in self.decode(start, end):
+                yield hashVal, songId, offset
@@ -2,8 +2,11 @@
 
 rm -f TestSet/*{1,2,3}.csv
 
+# Unchanged files come straight out of the fingerprint cache.
+FPCACHE=${FPCACHE:-TestSet/cache}
+
 for f in TestSet/*{1,2,3}.wav
 do
     echo "Fingerprinting $f"
-    ./FingerPrinter $f > "${f%.wav}.csv"
+    ./FingerPrinter $f -c "$FPCACHE" > "${f%.wav}.csv"
 done
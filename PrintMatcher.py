@@ -3,13 +3,28 @@
 # Takes a recorded fingerprint through a file and compares it to a file or
 # database, trying to find a likely match.
 import argparse
+import heapq
+import io
 import sqlite3
 import sys
-from os.path import splitext
+from os.path import isdir, splitext
+
+import SegmentIndex
+import ShardedIndex
 
 BINSIZE = 4
 MATCHTHRESHOLD = 100
 
+# Top-k matching: how far ahead the k-th best song has to be of anything that
+# could still overtake it before the matcher stops early, and how many
+# snippet fingerprints go by between pruning passes.
+MARGIN = 20
+PRUNEEVERY = 8
+
+# Hashes per posting count query, well under sqlite's limit on query
+# parameters.
+COUNTBATCH = 500
+
 ############################################################################
 ### DeltaBin class
 ###
@@ -36,6 +51,14 @@ class DeltaBin:
         if self.numbers[index] > self.maxBin:
             self.maxBin = self.numbers[index]
 
+    def merge(self, numbers):
+        """Add the bin counts of another DeltaBin's numbers to this one."""
+        for index, count in numbers.items():
+            total = self.numbers.get(index, 0) + count
+            self.numbers[index] = total
+            if total > self.maxBin:
+                self.maxBin = total
+
     def largestBin(self):
         """Return the number of deltas in the largest bin."""
         return self.maxBin
@@ -50,6 +73,29 @@ def hashMatchesFromDB(dbCursor, hashVal):
              WHERE hash = %d" % hashVal)
     return dbCursor.fetchall()
 
+def hashCountsFromDB(dbCursor, hashes):
+    """Count the fingerprints of many hashes at once from a database
+    connection, a few hundred hashes per query. Returns a dictionary of
+    hash: (count, hash) for the hashes that have any, in the form topMatches
+    wants."""
+    hashes = list(hashes)
+    counts = {}
+    for i in range(0, len(hashes), COUNTBATCH):
+        batch = hashes[i:i + COUNTBATCH]
+        marks = ','.join('?' * len(batch))
+        dbCursor.execute(
+                "SELECT hash, COUNT(*) FROM fingerprints \
+                 WHERE hash IN (%s) GROUP BY hash" % marks, batch)
+        for hashVal, count in dbCursor.fetchall():
+            counts[hashVal] = (count, hashVal)
+    return counts
+
+def readStoplist(path):
+    """Read a stoplist file of one hash per line, as written by
+    HashStats.py."""
+    with open(path, 'r') as stream:
+        return frozenset(int(line) for line in stream if line.strip())
+
 def hashMatchesFromFile(stream, hashVal):
     """Get matches of a hash from a given file stream."""
     results = []
@@ -62,11 +108,11 @@ def hashMatchesFromFile(stream, hashVal):
     stream.seek(0)
     return results
 
-def matchesBetweenFiles(snippetStream, masterStream):
+def matchesBetweenFiles(snippetStream, masterStream, binSize=BINSIZE):
     """Gets the number of time delta matches in the largest delta bin made
     of matches between the fingerprints in two files."""
     # matching stream 1 against stream 2
-    matchBins = DeltaBin(BINSIZE)
+    matchBins = DeltaBin(binSize)
     for line in snippetStream:
         fp = line.split(',')
         hashVal = int(fp[0])
@@ -78,9 +124,30 @@ def matchesBetweenFiles(snippetStream, masterStream):
     return matchBins.largestBin()
 
 
-def matchesInDB(snippetStream, dbCursor):
+def matchesInDB(snippetStream, dbCursor, binSize=BINSIZE):
     """Try to find a song match for the fingerprint in the given sqlite
     database. Returns a dictionary of songId: mostMatches pairs."""
+    return matchesFromLookup(snippetStream,
+            lambda hashVal: hashMatchesFromDB(dbCursor, hashVal), binSize)
+
+def matchesInIndex(snippetStream, snapshot, binSize=BINSIZE):
+    """Try to find a song match for the fingerprint in a snapshot of a
+    segment index. Returns a dictionary of songId: mostMatches pairs.
+
+    Postings are decoded straight into the delta bins, without building
+    lists of rows."""
+    matches = {}
+    newBins = lambda: DeltaBin(binSize)
+    for line in snippetStream:
+        fp = line.split(',')
+        snapshot.tally(int(fp[0]), int(fp[1]), matches, newBins)
+
+    return {songId: bins.largestBin() for songId, bins in matches.items()}
+
+def matchesFromLookup(snippetStream, lookup, binSize=BINSIZE):
+    """Match a snippet against any store of fingerprints, given a function
+    from a hash to the (songId, offset) rows holding it. Returns a dictionary
+    of songId: mostMatches pairs."""
 
     # For each fingerprint in the file, get matching fingerprints.
     # Record the time delta between them, and the song id of the match.
@@ -89,7 +156,7 @@ def matchesInDB(snippetStream, dbCursor):
         fp = line.split(',')
         hashVal = int(fp[0])
         offset = int(fp[1])
-        results = hashMatchesFromDB(dbCursor, hashVal)
+        results = lookup(hashVal)
         for row in results:
             songId = row[0]
             offset2 = row[1]
@@ -97,52 +164,195 @@ def matchesInDB(snippetStream, dbCursor):
             if songId in matches:
                 matches[songId].add(delta)
             else:
-                matches[songId] = DeltaBin(BINSIZE)
+                matches[songId] = DeltaBin(binSize)
                 matches[songId].add(delta)
         
     return {songId: bins.largestBin() for songId, bins in matches.items()}
 
 
+def topMatches(snippetStream, locate, fetch, k=1, margin=MARGIN,
+        binSize=BINSIZE, minMatches=MATCHTHRESHOLD):
+    """Find only the k best matching songs for a snippet. locate maps a
+    collection of hashes to a dictionary of hash: (rows, where) for those
+    that have any, rows being how many (songId, offset) rows the hash has or
+    an upper bound on it, and fetch maps a where to the rows themselves. The
+    store is asked about all the snippet's hashes at once, and whatever
+    locate found out is reused to fetch the rows.
+
+    Snippet fingerprints are looked up rarest hash first. One snippet
+    fingerprint can add at most min(binSize, rows) to any one delta bin, so
+    the rest of the snippet bounds how much any song can still gain. Songs
+    that can't catch the k-th best are dropped, new songs stop being tracked
+    once they couldn't reach the top k, and matching stops early once the
+    k-th best has at least minMatches and leads everything outside the top k
+    by margin even if that got every remaining match. Counts of an early
+    stop are lower bounds.
+
+    Returns a list of (songId, mostMatches) pairs, best first."""
+    if k < 1:
+        raise ValueError('top-k matching needs k of at least 1, not {}'
+                .format(k))
+
+    fingerprints = []
+    for line in snippetStream:
+        fp = line.split(',')
+        fingerprints.append((int(fp[0]), int(fp[1])))
+
+    located = locate({hashVal for hashVal, _ in fingerprints})
+    counts = {hashVal: found[0] for hashVal, found in located.items()}
+    fingerprints = sorted((fp for fp in fingerprints if counts.get(fp[0])),
+            key=lambda fp: counts[fp[0]])
+
+    # Most any single bin can still gain from the unprocessed fingerprints.
+    remaining = sum(min(binSize, counts[hashVal])
+            for hashVal, _ in fingerprints)
+
+    matches = {}
+    dropped = set()
+    closed = False
+    for i, (hashVal, offset) in enumerate(fingerprints):
+        remaining -= min(binSize, counts[hashVal])
+        for songId, offset2 in fetch(located[hashVal][1]):
+            bins = matches.get(songId)
+            if bins is None:
+                if closed or songId in dropped:
+                    continue
+                bins = matches[songId] = DeltaBin(binSize)
+            bins.add(offset2 - offset)
+
+        if i % PRUNEEVERY != PRUNEEVERY - 1 and remaining:
+            continue
+
+        best = heapq.nlargest(k + 1, (bins.largestBin()
+                for bins in matches.values()))
+        kth = best[k - 1] if len(best) >= k else 0
+        outside = best[k] if len(best) > k else 0
+
+        for songId in [songId for songId, bins in matches.items()
+                if bins.largestBin() + remaining < kth]:
+            del matches[songId]
+            dropped.add(songId)
+        closed = remaining < kth
+
+        if kth >= minMatches and kth >= outside + remaining + margin:
+            break
+
+    ranked = sorted(((songId, bins.largestBin())
+            for songId, bins in matches.items()),
+            key=lambda match: match[1], reverse=True)
+    return ranked[:k]
+
 ############################################################################
 
-usageString = """Usage: python3 {fn} <snippetFile> <masterFile | sqliteFile>
+usageString = """Match a file of snippet fingerprints against a master file or
+sqlite database of fingerprinted full songs. SnippetFile is a csv file of hash,
+timeWindow pairs, and masterFile is either a csv file of hash, timeWindow pairs,
+a sqlite database file or a (sharded) segment index directory."""
 
-Match a file of snippet fingerprints against a master file or sqlite database
-of fingerprinted full songs. SnippetFile is a csv file of hash, timeWindow
-pairs, and masterFile is either a csv file of hash, timeWindow pairs or
-a sqlite database file.""".format(fn=sys.argv[0])
+def printMatches(snippetFilename, masterFilename, matches):
+    """Print (songId, matches) pairs of a snippet against a database."""
+    print("{snip} against {db}".format(snip=snippetFilename,
+            db=masterFilename))
+    print("SongId:\tMatches:")
+    for songId, num in matches:
+        print("{id}\t{num}".format(id=songId, num=num))
 
 if __name__ == '__main__':
-    if len(sys.argv) != 3:
-        print(usageString)
-        exit(1)
+    parser = argparse.ArgumentParser(description=usageString)
+    parser.add_argument('snippetFile')
+    parser.add_argument('masterFile',
+            help='master csv, sqlite file or index directory')
+    parser.add_argument('--binsize', type=int, default=BINSIZE,
+            help='width of the time delta histogram bins')
+    parser.add_argument('--top-k', type=int, default=0,
+            help='only find the k best songs, pruning and stopping early')
+    parser.add_argument('--margin', type=int,
+            help='lead over the runner-up needed to stop early (default '
+            '{})'.format(MARGIN))
+    parser.add_argument('--min-matches', type=int,
+            help='matches the k-th best needs before stopping early '
+            '(default {})'.format(MATCHTHRESHOLD))
+    parser.add_argument('--stoplist',
+            help='file of hashes to leave out of the snippet')
+    args = parser.parse_args()
 
-    snippetFilename = sys.argv[1]
-    masterFilename = sys.argv[2]
+    snippetFilename = args.snippetFile
+    masterFilename = args.masterFile
 
     snippetStream = open(snippetFilename, 'r')
+    if args.top_k < 0:
+        parser.error('--top-k must be at least 1, or 0 to tally every song')
+
+    if args.margin is None:
+        margin = MARGIN
+    else:
+        margin = args.margin
+    if args.min_matches is None:
+        minMatches = MATCHTHRESHOLD
+    else:
+        minMatches = args.min_matches
+
+    if args.stoplist:
+        stoplist = readStoplist(args.stoplist)
+        lines = [line for line in snippetStream
+                if int(line.split(',')[0]) not in stoplist]
+        snippetStream.close()
+        snippetStream = io.StringIO(''.join(lines))
 
     _, ext = splitext(masterFilename)
-    if ext == '.sqlite':
+    if isdir(masterFilename) and ShardedIndex.isShardedIndex(masterFilename):
+        # A song's matches are spread over every shard, so no shard can
+        # tell on its own which songs could still make the top k. Sharded
+        # indexes tally every song and only keep the k best afterwards.
+        if args.margin is not None or args.min_matches is not None:
+            parser.error('--margin and --min-matches need an unsharded '
+                    'index; --top-k on a sharded index only limits the '
+                    'output')
+        with ShardedIndex.ShardServer(masterFilename) as server:
+            dbMatches = server.match(snippetStream, args.binsize)
+        if args.top_k:
+            dbMatches = sorted(dbMatches.items(), key=lambda m: m[1],
+                    reverse=True)[:args.top_k]
+        else:
+            dbMatches = dbMatches.items()
+        printMatches(snippetFilename, masterFilename, dbMatches)
+        snippetStream.close()
+
+    elif isdir(masterFilename) and SegmentIndex.isIndex(masterFilename):
+        with SegmentIndex.Snapshot(masterFilename) as snapshot:
+            if args.top_k:
+                dbMatches = topMatches(snippetStream, snapshot.locate,
+                        snapshot.fetch, args.top_k, margin,
+                        args.binsize, minMatches)
+            else:
+                dbMatches = matchesInIndex(snippetStream, snapshot,
+                        args.binsize).items()
+        printMatches(snippetFilename, masterFilename, dbMatches)
+        snippetStream.close()
+
+    elif ext == '.sqlite':
         conn = sqlite3.connect(masterFilename)
         curs = conn.cursor()
         
-        dbMatches = matchesInDB(snippetStream, curs)
-        print("{snip} against {db}".format(snip=snippetFilename,
-                db=masterFilename))
-        print("SongId:\tMatches:")
-        for songId, matches in dbMatches.items():
-            print("{id}\t{num}".format(id=songId, num=matches))
+        if args.top_k:
+            dbMatches = topMatches(snippetStream,
+                    lambda hashes: hashCountsFromDB(curs, hashes),
+                    lambda h: hashMatchesFromDB(curs, h), args.top_k,
+                    margin, args.binsize, minMatches)
+        else:
+            dbMatches = matchesInDB(snippetStream, curs,
+                    args.binsize).items()
+        printMatches(snippetFilename, masterFilename, dbMatches)
         snippetStream.close()
 
     elif ext == '.csv':
         masterStream = open(masterFilename, 'r')
-        matches = matchesBetweenFiles(snippetStream, masterStream)
+        matches = matchesBetweenFiles(snippetStream, masterStream,
+                args.binsize)
         print("{mf}\t{sf}\t{matches}".format(mf=masterFilename,
                         sf=snippetFilename, matches=matches))
         masterStream.close()
         snippetStream.close()
 
     else:
-        print(usageString)
-
+        parser.print_usage()
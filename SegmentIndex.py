@@ -0,0 +1,550 @@
+# SegmentIndex.py
+# A fingerprint index made of small immutable segments.
+# Each segment is a file of compressed posting lists (see Postings.py),
+# written once and never modified. A MANIFEST file lists the live segments,
+# the songs in each, the tombstones of deleted songs and the song ids that
+# adds still in progress have reserved. Writers build new segments off to the
+# side and then swap in a new manifest with an atomic rename, holding a lock
+# only for the swap. Readers take a snapshot of the manifest and never lock,
+# so queries run at full speed while songs are added, deleted or segments are
+# merged in the background.
+#
+# An index can also have a stoplist of hashes too common to tell songs apart
+# (see HashStats.py). They are dropped from new and merged segments and
+# ignored by queries.
+import argparse
+import fcntl
+import json
+import os
+import re
+import subprocess
+import sys
+import threading
+
+import Postings
+
+FINGERPRINTER = './FingerPrinter'
+
+MANIFEST = 'MANIFEST'
+LOCKFILE = 'LOCK'
+
+# Compaction merges segments until there are at most this many.
+MAXSEGMENTS = 8
+
+# Strips the FingerPrinter output suffixes off a file name to get a title.
+TITLEPATTERN = re.compile(r'(FULL)?(ID)?$')
+
+############################################################################
+### Manifest handling
+###
+
+def emptyManifest():
+    return {'nextSegment': 1, 'nextSongId': 1, 'segments': [],
+            'tombstones': [], 'reserved': []}
+
+def readManifest(indexDir, name=MANIFEST):
+    """Read the current manifest of an index."""
+    with open(os.path.join(indexDir, name), 'r') as stream:
+        return json.load(stream)
+
+def writeManifest(indexDir, manifest, name=MANIFEST):
+    """Atomically replace the manifest of an index. Readers see either the
+    old or the new manifest, never a partial one. Every write bumps the
+    manifest's generation, so readers can tell it changed."""
+    manifest['generation'] = manifest.get('generation', 0) + 1
+    path = os.path.join(indexDir, name)
+    with open(path + '.tmp', 'w') as stream:
+        json.dump(manifest, stream, indent=1)
+        stream.flush()
+        os.fsync(stream.fileno())
+    os.replace(path + '.tmp', path)
+
+class WriterLock:
+    """Serializes manifest updates between writers. Readers never take it."""
+
+    def __init__(self, indexDir):
+        self.path = os.path.join(indexDir, LOCKFILE)
+
+    def __enter__(self):
+        self.stream = open(self.path, 'a')
+        fcntl.flock(self.stream, fcntl.LOCK_EX)
+        return self
+
+    def __exit__(self, *exc):
+        fcntl.flock(self.stream, fcntl.LOCK_UN)
+        self.stream.close()
+
+def readStoplist(indexDir, manifest):
+    """The stoplisted hashes named by a manifest, as a frozenset."""
+    if not manifest.get('stoplist'):
+        return frozenset()
+    with open(os.path.join(indexDir, manifest['stoplist']), 'r') as stream:
+        return frozenset(int(line) for line in stream if line.strip())
+
+def installStoplist(indexDir, hashes, replace=False):
+    """Add hashes to the stoplist of an index, or with replace, make them
+    the whole stoplist. Hashes already stoplisted are compacted out of the
+    index, so they look rare to HashStats.py afterwards; adding keeps them
+    stoplisted. Segments written under an older stoplist are rewritten by
+    the next compaction."""
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir)
+        old = manifest.get('stoplist')
+        if not replace:
+            hashes = set(hashes) | readStoplist(indexDir, manifest)
+        name = 'stoplist-{:06d}.txt'.format(manifest['nextSegment'])
+        manifest['nextSegment'] += 1
+        path = os.path.join(indexDir, name)
+        with open(path + '.tmp', 'w') as stream:
+            for hashVal in sorted(hashes):
+                stream.write('{}\n'.format(hashVal))
+        os.replace(path + '.tmp', path)
+        manifest['stoplist'] = name
+        writeManifest(indexDir, manifest)
+    if old:
+        os.remove(os.path.join(indexDir, old))
+
+def initIndex(indexDir):
+    """Create an empty index directory."""
+    os.makedirs(indexDir, exist_ok=True)
+    with WriterLock(indexDir):
+        if not os.path.exists(os.path.join(indexDir, MANIFEST)):
+            writeManifest(indexDir, emptyManifest())
+
+############################################################################
+### Writing segments
+###
+
+def newSegmentName(manifest):
+    """Reserve the next segment file name. Caller holds the writer lock."""
+    name = 'seg-{:06d}.seg'.format(manifest['nextSegment'])
+    manifest['nextSegment'] += 1
+    return name
+
+def writeSegment(indexDir, name, songs, rows):
+    """Write an immutable segment file from (songId, title) pairs and
+    (songId, hash, offset) rows. Returns the number of rows written.
+
+    The segment is built under a temporary name and renamed into place, so a
+    half-written segment is never visible."""
+    path = os.path.join(indexDir, name)
+    try:
+        count = Postings.writeSegmentFile(path + '.tmp', songs, rows)
+        os.replace(path + '.tmp', path)
+    except BaseException:
+        if os.path.exists(path + '.tmp'):
+            os.remove(path + '.tmp')
+        raise
+    return count
+
+def readCSVSong(path):
+    """Read the rows of a FingerPrinter csv made with -s <songId>."""
+    with open(path, 'r') as stream:
+        rows = [tuple(int(v) for v in line.split(',')) for line in stream]
+    if not rows:
+        raise ValueError('{} has no fingerprints'.format(path))
+    if len(rows[0]) != 3:
+        raise ValueError('{} has no song ids, make it with -s'.format(path))
+    return rows
+
+def titleOf(path):
+    name, _ = os.path.splitext(os.path.basename(path))
+    return TITLEPATTERN.sub('', name) or name
+
+def liveSongs(manifest):
+    """Song ids held by any segment, deleted or not."""
+    return {s for seg in manifest['segments'] for s in seg['songs']}
+
+def reserveSongIds(indexDir, files, csvRows, name=MANIFEST,
+        published=liveSongs):
+    """Check that csv files don't reuse song ids and hand out fresh ids for
+    wav files, from the manifest called name. published gives the ids
+    already in segments, from that manifest. Every id of the batch stays
+    reserved in the manifest until releaseSongIds, so adds running at the
+    same time can't take it either. Returns the fresh ids."""
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir, name)
+        reserved = set(manifest.get('reserved', []))
+        taken = published(manifest) | reserved
+        csvIds = set()
+        for path, songRows in csvRows.items():
+            songId = songRows[0][0]
+            if songId in taken or songId in csvIds:
+                raise ValueError('song id {} from {} is already in the index'
+                        .format(songId, path))
+            csvIds.add(songId)
+        # Every id published or reserved so far is below nextSongId.
+        manifest['nextSongId'] = max([manifest['nextSongId']]
+                + [songId + 1 for songId in csvIds])
+        songIds = []
+        for path in files:
+            if path.endswith('.wav'):
+                songIds.append(manifest['nextSongId'])
+                manifest['nextSongId'] += 1
+        manifest['reserved'] = sorted(reserved | csvIds | set(songIds))
+        writeManifest(indexDir, manifest, name)
+    return songIds
+
+def releaseSongIds(indexDir, songIds, name=MANIFEST):
+    """Drop reservations made by reserveSongIds, once the songs are
+    published or their add failed."""
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir, name)
+        manifest['reserved'] = sorted(
+                set(manifest.get('reserved', [])) - set(songIds))
+        writeManifest(indexDir, manifest, name)
+
+def batchSongIds(csvRows, songIds):
+    """Every song id a batch uses: its csv ids and its fresh wav ids."""
+    return [songRows[0][0] for songRows in csvRows.values()] + list(songIds)
+
+def fingerprintFile(path, songId, fingerprinter=FINGERPRINTER, fpArgs=()):
+    """Fingerprint a wav file, returning its (songId, hash, offset) rows."""
+    command = [fingerprinter, path, '-s', str(songId)] + list(fpArgs)
+    output = subprocess.run(command, check=True, stdout=subprocess.PIPE,
+            universal_newlines=True).stdout
+    return [tuple(int(v) for v in line.split(','))
+            for line in output.splitlines()]
+
+def loadSongs(files, songIds, csvRows, fingerprinter=FINGERPRINTER,
+        fpArgs=()):
+    """Gather the (songId, title) pairs and fingerprint rows of a batch of
+    files, fingerprinting wav files with the given fresh song ids."""
+    songs = []
+    rows = []
+    fresh = iter(songIds)
+    for path in files:
+        if path.endswith('.wav'):
+            songId = next(fresh)
+            songRows = fingerprintFile(path, songId, fingerprinter, fpArgs)
+        else:
+            songRows = csvRows[path]
+            songId = songRows[0][0]
+        songs.append((songId, titleOf(path)))
+        rows.extend(songRows)
+    return songs, rows
+
+def addSegment(indexDir, songs, rows):
+    """Write (songId, title) pairs and their fingerprint rows as a new
+    segment and publish it. Returns the song ids of the segment."""
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir)
+        name = newSegmentName(manifest)
+        writeManifest(indexDir, manifest)
+        stoplistName = manifest.get('stoplist')
+        stoplist = readStoplist(indexDir, manifest)
+
+    # Building the segment happens outside of the lock.
+    if stoplist:
+        rows = [row for row in rows if row[1] not in stoplist]
+    count = writeSegment(indexDir, name, songs, rows)
+    added = sorted({songId for songId, _ in songs})
+
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir)
+        manifest['segments'].append({'name': name, 'songs': added,
+            'fingerprints': count, 'stoplist': stoplistName})
+        manifest['nextSongId'] = max([manifest['nextSongId']]
+                + [songId + 1 for songId in added])
+        if 'reserved' in manifest:
+            manifest['reserved'] = sorted(
+                    set(manifest['reserved']) - set(added))
+        writeManifest(indexDir, manifest)
+
+    return added
+
+def addSongs(indexDir, files, fingerprinter=FINGERPRINTER, fpArgs=()):
+    """Add a batch of songs to the index as one new segment.
+
+    Wav files are fingerprinted with fresh song ids. Csv files must be
+    FingerPrinter output made with -s, and keep their song ids, which must not
+    already be in the index (deleted songs count until they are compacted
+    away). Returns the song ids that were added."""
+    csvRows = {path: readCSVSong(path) for path in files
+            if not path.endswith('.wav')}
+    songIds = reserveSongIds(indexDir, files, csvRows)
+    try:
+        songs, rows = loadSongs(files, songIds, csvRows, fingerprinter,
+                fpArgs)
+        # Publishing the segment releases its ids.
+        return addSegment(indexDir, songs, rows)
+    except BaseException:
+        releaseSongIds(indexDir, batchSongIds(csvRows, songIds))
+        raise
+
+def deleteSongs(indexDir, songIds):
+    """Delete songs by recording tombstones. Their rows are dropped for good
+    the next time the segments holding them are merged."""
+    with WriterLock(indexDir):
+        manifest = readManifest(indexDir)
+        live = liveSongs(manifest)
+        tombstones = set(manifest['tombstones'])
+        tombstones.update(s for s in songIds if s in live)
+        manifest['tombstones'] = sorted(tombstones)
+        writeManifest(indexDir, manifest)
+
+############################################################################
+### Compaction
+###
+
+def pickSegments(manifest, maxSegments):
+    """Choose the segments for one merge: every segment holding a deleted
+    song or written under an older stoplist, plus the smallest segments until
+    at most maxSegments remain."""
+    segments = manifest['segments']
+    tombstones = set(manifest['tombstones'])
+    stoplist = manifest.get('stoplist')
+    chosen = [seg for seg in segments if tombstones.intersection(seg['songs'])
+            or seg.get('stoplist') != stoplist]
+
+    rest = sorted((seg for seg in segments if seg not in chosen),
+            key=lambda seg: seg['fingerprints'])
+    excess = len(segments) - maxSegments
+    if excess > 0:
+        # Merging k segments into one removes k - 1 of them.
+        chosen.extend(rest[:max(excess + 1 - len(chosen), 0)])
+    return chosen
+
+def mergeSegments(indexDir, segments, tombstones, stoplist, name):
+    """Write the live rows of the given segments into a new segment, leaving
+    out deleted songs and stoplisted hashes. Returns (song ids, row count)
+    of the merged segment."""
+    songs = []
+    rows = []
+    for seg in segments:
+        segment = Postings.Segment(os.path.join(indexDir, seg['name']))
+        songs.extend(song for song in segment.songTable
+                if song[0] not in tombstones)
+        rows.extend((songId, hashVal, offset)
+                for hashVal, songId, offset in segment.entries()
+                if songId not in tombstones and hashVal not in stoplist)
+        segment.close()
+
+    count = writeSegment(indexDir, name, songs, rows)
+    songIds = sorted({row[0] for row in rows} | {s for s, _ in songs})
+    return songIds, count
+
+def compact(indexDir, maxSegments=MAXSEGMENTS):
+    """Merge segments until there are at most maxSegments and no segment
+    holds deleted songs or stoplisted hashes. Safe to run alongside queries
+    and other writers.
+    Returns the number of merges done."""
+    merges = 0
+    while True:
+        with WriterLock(indexDir):
+            manifest = readManifest(indexDir)
+            chosen = pickSegments(manifest, maxSegments)
+            if not chosen:
+                return merges
+            name = newSegmentName(manifest)
+            writeManifest(indexDir, manifest)
+            stoplistName = manifest.get('stoplist')
+            stoplist = readStoplist(indexDir, manifest)
+        tombstones = set(manifest['tombstones'])
+
+        # The merge itself runs without the lock.
+        songIds, count = mergeSegments(indexDir, chosen, tombstones,
+                stoplist, name)
+
+        with WriterLock(indexDir):
+            manifest = readManifest(indexDir)
+            names = [seg['name'] for seg in manifest['segments']]
+            if not all(seg['name'] in names for seg in chosen):
+                # Another compaction got to these segments first.
+                os.remove(os.path.join(indexDir, name))
+                continue
+            chosenNames = {seg['name'] for seg in chosen}
+            position = names.index(chosen[0]['name'])
+            segments = [seg for seg in manifest['segments']
+                    if seg['name'] not in chosenNames]
+            if songIds:
+                segments.insert(position, {'name': name, 'songs': songIds,
+                    'fingerprints': count, 'stoplist': stoplistName})
+            else:
+                os.remove(os.path.join(indexDir, name))
+            manifest['segments'] = segments
+
+            # Tombstones whose songs are gone from every segment are done.
+            live = liveSongs(manifest)
+            manifest['tombstones'] = [t for t in manifest['tombstones']
+                    if t in live]
+            writeManifest(indexDir, manifest)
+
+        # Readers that already opened these keep reading them until they
+        # close; readers that race the unlink retry with the new manifest.
+        for seg in chosen:
+            os.remove(os.path.join(indexDir, seg['name']))
+        merges += 1
+
+def compactInBackground(indexDir, maxSegments=MAXSEGMENTS):
+    """Start compacting on a background thread, returning the thread."""
+    thread = threading.Thread(target=compact, args=(indexDir, maxSegments),
+            daemon=True)
+    thread.start()
+    return thread
+
+def spawnCompactor(indexDir, maxSegments=MAXSEGMENTS):
+    """Start compacting in a detached background process, which outlives
+    the current one."""
+    return subprocess.Popen(
+        [sys.executable, os.path.abspath(__file__), indexDir, 'compact',
+            '--max-segments', str(maxSegments)],
+        stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+        start_new_session=True)
+
+############################################################################
+### Reading
+###
+
+class Snapshot:
+    """A consistent read-only view of an index: the segments listed in one
+    manifest. Later changes to the index aren't seen by an open snapshot."""
+
+    def __init__(self, indexDir):
+        self.indexDir = indexDir
+        # A compaction may remove a segment between reading the manifest
+        # and opening it; when that happens just read the new manifest.
+        while True:
+            manifest = readManifest(indexDir)
+            segments = []
+            try:
+                for seg in manifest['segments']:
+                    segments.append(Postings.Segment(
+                        os.path.join(indexDir, seg['name'])))
+                stoplist = readStoplist(indexDir, manifest)
+                break
+            except FileNotFoundError:
+                for segment in segments:
+                    segment.close()
+        self.manifest = manifest
+        self.segments = segments
+        self.tombstones = frozenset(manifest['tombstones'])
+        self.stoplist = stoplist
+
+    def hashMatches(self, hashVal):
+        """(songId, offset) rows for a hash across all segments, leaving out
+        deleted songs and stoplisted hashes."""
+        results = []
+        if hashVal in self.stoplist:
+            return results
+        for segment in self.segments:
+            results.extend(row for row in segment.hashMatches(hashVal)
+                    if row[0] not in self.tombstones)
+        return results
+
+    def locate(self, hashes):
+        """Find many hashes in every segment at once, for
+        PrintMatcher.topMatches. Returns a dictionary of hash: (postings,
+        places) for the hashes with any postings, where places lists the
+        (segment, start, end) byte ranges to decode with fetch. Postings of
+        deleted songs are counted too, so the count is an upper bound."""
+        located = {}
+        for hashVal in hashes:
+            if hashVal in self.stoplist:
+                continue
+            total = 0
+            places = []
+            for segment in self.segments:
+                found = segment.find(hashVal)
+                if found is not None:
+                    total += found[0]
+                    places.append((segment, found[1], found[2]))
+            if places:
+                located[hashVal] = (total, places)
+        return located
+
+    def fetch(self, places):
+        """(songId, offset) rows of places found by locate, leaving out
+        deleted songs."""
+        results = []
+        for segment, start, end in places:
+            results.extend(row for row in segment.decode(start, end)
+                    if row[0] not in self.tombstones)
+        return results
+
+    def tally(self, hashVal, offset, matches, newBins):
+        """Add the deltas of a snippet fingerprint against every live posting
+        of its hash to matches, a dict of songId: DeltaBin."""
+        if hashVal in self.stoplist:
+            return
+        for segment in self.segments:
+            segment.tally(hashVal, offset, matches, newBins, self.tombstones)
+
+    def songs(self):
+        """All (songId, title) pairs that aren't deleted."""
+        results = []
+        for segment in self.segments:
+            results.extend(song for song in segment.songTable
+                    if song[0] not in self.tombstones)
+        return sorted(results)
+
+    def close(self):
+        for segment in self.segments:
+            segment.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+def isIndex(path):
+    return os.path.isfile(os.path.join(path, MANIFEST))
+
+############################################################################
+
+usageString = """Manage a segment-based fingerprint index directory.
+
+  init                       create an empty index
+  add <file>...              add wav files (fingerprinted with new song ids)
+                             or FingerPrinter -s csv files as one segment
+  delete <songId>...         delete songs
+  compact                    merge segments now
+  list                       show segments, songs and tombstones"""
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=usageString,
+            formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('indexDir')
+    parser.add_argument('command',
+            choices=['init', 'add', 'delete', 'compact', 'list'])
+    parser.add_argument('args', nargs='*')
+    parser.add_argument('--max-segments', type=int, default=MAXSEGMENTS,
+            help='compact down to this many segments')
+    parser.add_argument('--fingerprinter', default=FINGERPRINTER)
+    parser.add_argument('--fpargs', default='',
+            help='extra FingerPrinter arguments for wav files')
+    parser.add_argument('--no-compact', action='store_true',
+            help="don't start a background compaction after adding")
+    args = parser.parse_args()
+
+    if args.command == 'init':
+        initIndex(args.indexDir)
+
+    elif args.command == 'add':
+        if not isIndex(args.indexDir):
+            initIndex(args.indexDir)
+        added = addSongs(args.indexDir, args.args, args.fingerprinter,
+                args.fpargs.split())
+        print('added songs {}'.format(' '.join(str(s) for s in added)))
+        segments = len(readManifest(args.indexDir)['segments'])
+        if not args.no_compact and segments > args.max_segments:
+            spawnCompactor(args.indexDir, args.max_segments)
+
+    elif args.command == 'delete':
+        deleteSongs(args.indexDir, [int(s) for s in args.args])
+
+    elif args.command == 'compact':
+        merges = compact(args.indexDir, args.max_segments)
+        print('{} merges'.format(merges))
+
+    elif args.command == 'list':
+        manifest = readManifest(args.indexDir)
+        print('Segment:\tFingerprints:\tSongs:')
+        for seg in manifest['segments']:
+            print('{}\t{}\t{}'.format(seg['name'], seg['fingerprints'],
+                ' '.join(str(s) for s in seg['songs'])))
+        print('Tombstones: {}'.format(
+            ' '.join(str(s) for s in manifest['tombstones'])))
+        print('Stoplisted hashes: {}'.format(
+            len(readStoplist(args.indexDir, manifest))))
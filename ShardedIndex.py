@@ -0,0 +1,263 @@
+# ShardedIndex.py
+# A fingerprint index split into shards by hash, queried in parallel.
+# Each shard is its own segment index directory (see SegmentIndex.py) holding
+# the fingerprints whose hash falls in its part of the hash space, so the
+# catalog can grow past what one file or one process handles well. A query
+# scatters its fingerprints to the shards that own their hashes, one worker
+# process per shard tallies (songId, delta bin) votes from its postings, and
+# the votes are summed into per-song histograms.
+#
+# Adds and deletes are published one shard at a time, and there is no
+# snapshot across shards: a query running alongside them can see a song in
+# some shards but not yet (or no longer) in others, and count it short.
+import argparse
+import multiprocessing
+import multiprocessing.connection
+import os
+
+import PrintMatcher
+import SegmentIndex
+
+SHARDS = 'SHARDS'
+DEFAULTSHARDS = 4
+
+# Fingerprint hashes keep most of their entropy in the low bits, so the
+# shard comes from the top bits of a multiplicative (Fibonacci) hash of them.
+GOLDEN = 2654435761
+
+def shardOf(hashVal, shards):
+    """The shard that owns a hash."""
+    return (((hashVal * GOLDEN) & 0xffffffff) * shards) >> 32
+
+def shardDir(indexDir, shard):
+    return os.path.join(indexDir, 'shard-{:03d}'.format(shard))
+
+def isShardedIndex(path):
+    return os.path.isfile(os.path.join(path, SHARDS))
+
+def shardCount(indexDir):
+    return SegmentIndex.readManifest(indexDir, SHARDS)['shards']
+
+############################################################################
+### Writing
+###
+
+def initIndex(indexDir, shards=DEFAULTSHARDS):
+    """Create an empty sharded index."""
+    os.makedirs(indexDir, exist_ok=True)
+    with SegmentIndex.WriterLock(indexDir):
+        if not isShardedIndex(indexDir):
+            for shard in range(shards):
+                SegmentIndex.initIndex(shardDir(indexDir, shard))
+            SegmentIndex.writeManifest(indexDir,
+                    {'shards': shards, 'nextSongId': 1}, SHARDS)
+
+def addSongs(indexDir, files, fingerprinter=SegmentIndex.FINGERPRINTER,
+        fpArgs=()):
+    """Add a batch of songs, as one new segment in every shard. Song ids are
+    handed out across the whole index. The shards are published one after
+    another, not all at once. Returns the song ids added."""
+    shards = shardCount(indexDir)
+    csvRows = {path: SegmentIndex.readCSVSong(path) for path in files
+            if not path.endswith('.wav')}
+    # Every shard lists every song, but each drops a deleted song only when
+    # it is compacted, so an id stays in use until every shard has dropped
+    # it. The shards are read under the index's lock, along with the ids
+    # other adds have reserved.
+    published = lambda manifest: set().union(*(
+            SegmentIndex.liveSongs(SegmentIndex.readManifest(
+                shardDir(indexDir, shard))) for shard in range(shards)))
+    songIds = SegmentIndex.reserveSongIds(indexDir, files, csvRows, SHARDS,
+            published)
+    try:
+        songs, rows = SegmentIndex.loadSongs(files, songIds, csvRows,
+                fingerprinter, fpArgs)
+
+        shardRows = [[] for _ in range(shards)]
+        for row in rows:
+            shardRows[shardOf(row[1], shards)].append(row)
+
+        added = []
+        for shard in range(shards):
+            added = SegmentIndex.addSegment(shardDir(indexDir, shard), songs,
+                    shardRows[shard])
+    finally:
+        SegmentIndex.releaseSongIds(indexDir,
+                SegmentIndex.batchSongIds(csvRows, songIds), SHARDS)
+    return added
+
+def deleteSongs(indexDir, songIds):
+    """Tombstone songs in every shard, one shard after another."""
+    for shard in range(shardCount(indexDir)):
+        SegmentIndex.deleteSongs(shardDir(indexDir, shard), songIds)
+
+def compact(indexDir, maxSegments=SegmentIndex.MAXSEGMENTS):
+    """Compact every shard, in parallel. Returns the total merges done."""
+    shards = shardCount(indexDir)
+    with multiprocessing.Pool(shards) as pool:
+        return sum(pool.starmap(SegmentIndex.compact,
+            [(shardDir(indexDir, shard), maxSegments)
+                for shard in range(shards)]))
+
+############################################################################
+### Querying
+###
+
+def shardWorker(directory, connection):
+    """Serve tally requests for one shard until told to stop with None.
+
+    A request is a list of (hash, offset) snippet fingerprints and a bin
+    size; the reply maps songId to the {bin: count} votes of its postings.
+    The shard's snapshot is reopened whenever its manifest's generation
+    changes. (Inode numbers can't tell: the filesystem may hand a replaced
+    manifest's inode straight back to the next one.)"""
+    snapshot = SegmentIndex.Snapshot(directory)
+
+    while True:
+        request = connection.recv()
+        if request is None:
+            break
+        fingerprints, binSize = request
+
+        current = SegmentIndex.readManifest(directory).get('generation')
+        if current != snapshot.manifest.get('generation'):
+            snapshot.close()
+            snapshot = SegmentIndex.Snapshot(directory)
+
+        matches = {}
+        newBins = lambda: PrintMatcher.DeltaBin(binSize)
+        for hashVal, offset in fingerprints:
+            snapshot.tally(hashVal, offset, matches, newBins)
+        connection.send({songId: bins.numbers
+                for songId, bins in matches.items()})
+
+    snapshot.close()
+    connection.close()
+
+class ShardServer:
+    """A worker process per shard of an index, kept around across queries.
+    Use as a context manager so the workers are shut down."""
+
+    def __init__(self, indexDir):
+        self.shards = shardCount(indexDir)
+        self.connections = []
+        self.workers = []
+        for shard in range(self.shards):
+            ours, theirs = multiprocessing.Pipe()
+            worker = multiprocessing.Process(target=shardWorker,
+                    args=(shardDir(indexDir, shard), theirs), daemon=True)
+            worker.start()
+            theirs.close()
+            self.connections.append(ours)
+            self.workers.append(worker)
+
+    def match(self, snippetStream, binSize=None):
+        """Match a snippet against every shard at once. Returns a dictionary
+        of songId: mostMatches pairs, the same as PrintMatcher.matchesInDB
+        on an unsharded index."""
+        # PrintMatcher imports this module, so its defaults are looked up
+        # at call time.
+        if binSize is None:
+            binSize = PrintMatcher.BINSIZE
+        scattered = [[] for _ in range(self.shards)]
+        for line in snippetStream:
+            fp = line.split(',')
+            hashVal = int(fp[0])
+            scattered[shardOf(hashVal, self.shards)].append(
+                    (hashVal, int(fp[1])))
+
+        # Send everything before waiting on anything so the shards run at
+        # the same time.
+        for connection, fingerprints in zip(self.connections, scattered):
+            connection.send((fingerprints, binSize))
+
+        # Delta bins from different shards add up, so merging the votes
+        # gives exactly the histograms of an unsharded index. Replies are
+        # merged as they come in, while slower shards are still working.
+        matches = {}
+        waiting = list(self.connections)
+        while waiting:
+            for connection in multiprocessing.connection.wait(waiting):
+                waiting.remove(connection)
+                for songId, numbers in connection.recv().items():
+                    bins = matches.get(songId)
+                    if bins is None:
+                        bins = matches[songId] = PrintMatcher.DeltaBin(
+                                binSize)
+                    bins.merge(numbers)
+
+        return {songId: bins.largestBin() for songId, bins in matches.items()}
+
+    def close(self):
+        for connection in self.connections:
+            connection.send(None)
+            connection.close()
+        for worker in self.workers:
+            worker.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+############################################################################
+
+usageString = """Manage and query a hash-sharded fingerprint index directory.
+
+  init                       create an empty index (see --shards)
+  add <file>...              add wav files or FingerPrinter -s csv files
+  delete <songId>...         delete songs from every shard
+  compact                    merge segments of every shard in parallel
+  query <snippetCsv>...      match snippets, one worker process per shard"""
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=usageString,
+            formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('indexDir')
+    parser.add_argument('command',
+            choices=['init', 'add', 'delete', 'compact', 'query'])
+    parser.add_argument('args', nargs='*')
+    parser.add_argument('--shards', type=int, default=DEFAULTSHARDS)
+    parser.add_argument('--max-segments', type=int,
+            default=SegmentIndex.MAXSEGMENTS)
+    parser.add_argument('--fingerprinter',
+            default=SegmentIndex.FINGERPRINTER)
+    parser.add_argument('--fpargs', default='',
+            help='extra FingerPrinter arguments for wav files')
+    parser.add_argument('--no-compact', action='store_true',
+            help="don't start background compactions after adding")
+    parser.add_argument('--binsize', type=int, default=PrintMatcher.BINSIZE)
+    args = parser.parse_args()
+
+    if args.command == 'init':
+        initIndex(args.indexDir, args.shards)
+
+    elif args.command == 'add':
+        if not isShardedIndex(args.indexDir):
+            initIndex(args.indexDir, args.shards)
+        added = addSongs(args.indexDir, args.args, args.fingerprinter,
+                args.fpargs.split())
+        print('added songs {}'.format(' '.join(str(s) for s in added)))
+        # Every add puts a segment in every shard, so each shard gets its
+        # own background compaction, as an unsharded add does.
+        for shard in range(shardCount(args.indexDir)):
+            directory = shardDir(args.indexDir, shard)
+            segments = len(SegmentIndex.readManifest(directory)['segments'])
+            if not args.no_compact and segments > args.max_segments:
+                SegmentIndex.spawnCompactor(directory, args.max_segments)
+
+    elif args.command == 'delete':
+        deleteSongs(args.indexDir, [int(s) for s in args.args])
+
+    elif args.command == 'compact':
+        merges = compact(args.indexDir, args.max_segments)
+        print('{} merges'.format(merges))
+
+    elif args.command == 'query':
+        with ShardServer(args.indexDir) as server:
+            for snippetFilename in args.args:
+                with open(snippetFilename, 'r') as snippetStream:
+                    dbMatches = server.match(snippetStream, args.binsize)
+                PrintMatcher.printMatches(snippetFilename, args.indexDir,
+                        dbMatches.items())
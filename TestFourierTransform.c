@@ -35,6 +35,31 @@ void printCArrays(double complex * a, double complex * b, int n) {
     }
 }
 
+/* Checks that the planned, in-place fourier transform gives the same results
+ * as the recursive one on n random complex numbers. Returns 0 if it does. */
+int plannedTest(int n) {
+    double complex * input = malloc(sizeof(double complex) * n);
+    FFTPlan * plan = newFFTPlan(n);
+    if (input == NULL || plan == NULL) {
+        fprintf(stderr, "error, out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < n; i++)
+        input[i] = RDOUBLE() + RDOUBLE() * I;
+
+    double complex * expected = fastFourierTransform(input, n);
+    plannedFourierTransform(plan, input);
+    int result = !carrEquals(expected, input, n);
+    printf("planned transform of %d values: %s\n", n,
+            result ? "differs" : "matches");
+
+    free(input);
+    free(expected);
+    freeFFTPlan(plan);
+    return result;
+}
+
 /* Brief correctness test for fast fourier transform functions.
  * tests a couple of hard-coded examples, not exhaustive.
  * Returns 0 if everything was correct, 1 if any calls give incorrect results.
@@ -47,9 +72,12 @@ int correctnessTest() {
     double complex r2[] = {3 + 4 * I, -1 - 12 * I};
     double complex * x1, * x2;
     double complex * x3 = malloc(sizeof(double complex) * 2);
+    double complex x4[] = {1 + 3.0 * I, 1 - 4.0 * I};
+    FFTPlan * plan = newFFTPlan(2);
     x1 = slowFourierTransform(z, 2);
     x2 = fastFourierTransform(z, 2);
     fourierSlide(x2, x3, 1 + 3 * I, n, 2);
+    plannedFourierTransform(plan, x4);
 
     printf("Expected:\tGot: (slow)\n");
     printCArrays(r, x1, 2);
@@ -60,11 +88,17 @@ int correctnessTest() {
     printf("Expected:\tGot: (slide)\n");
     printCArrays(r2, x3, 2);
 
+    printf("Expected:\tGot: (planned)\n");
+    printCArrays(r, x4, 2);
+
     result = result || (!carrEquals(r, x1, 2));
     result = result || (!carrEquals(r, x2, 2));
+    result = result || (!carrEquals(r, x4, 2));
+    result = result || plannedTest(1024);
 
     free(x1);
     free(x2);
+    freeFFTPlan(plan);
 
     return result;
 }
@@ -104,8 +138,21 @@ void speedTest(int n) {
     secs = (double)(end - start) / CLOCKS_PER_SEC;
     printf("fast fourier transform took %f seconds.\n", secs);
 
+    FFTPlan * plan = newFFTPlan(n);
+    if (plan == NULL) {
+        fprintf(stderr, "error, out of memory\n");
+        exit(1);
+    }
+
+    start = clock();
+    plannedFourierTransform(plan, input);
+    end = clock();
+    secs = (double)(end - start) / CLOCKS_PER_SEC;
+    printf("planned fourier transform took %f seconds.\n", secs);
+
     free(input);
     free(output);
+    freeFFTPlan(plan);
 }
 
 #define PURESIZE 65536
@@ -129,7 +176,7 @@ void testPureTone() {
 
     printf("frequency:\t magnitude:\n");
     for (int i = 0; i < PURESIZE; i++) {
-        printf("%d:\t %.2f\n", i * 44100 / PURESIZE, cabs(output[i]));
+        printf("%ld:\t %.2f\n", (long) i * 44100 / PURESIZE, cabs(output[i]));
     }
 
     free(input);
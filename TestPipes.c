@@ -0,0 +1,123 @@
+/* TestPipes.c - tests that the fingerprinting library doesn't allocate once
+ * a context's buffers have grown, in every peak finding mode.
+ *
+ * The allocation functions are replaced with counting wrappers around
+ * glibc's own, so allocations made for the library inside the C library
+ * (by qsort, say) are counted too. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "Pipes.h"
+
+/* Length of the test clip, in frames. */
+#define FRAMES (44100 * 20)
+#define RATE 44100
+
+/* How many times each mode fingerprints the clip after warming up. */
+#define REPEATS 5
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * pointer, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+
+/* Allocations made while counting is on. */
+static long allocations = 0;
+static int counting = 0;
+
+void * malloc(size_t size) {
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+    allocations += counting;
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * pointer, size_t size) {
+    allocations += counting;
+    return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void ** pointer, size_t alignment, size_t size) {
+    allocations += counting;
+    *pointer = __libc_memalign(alignment, size);
+    return *pointer == NULL ? ENOMEM : 0;
+}
+
+/* Fills a clip with noise under a square wave, loud enough for every mode to
+ * find plenty of peaks. */
+void makeClip(int16_t * samples, int frames) {
+    srand(1);
+    for (int i = 0; i < frames; i++) {
+        int square = 8000 * ((i / 50) % 2);
+        samples[i] = (int16_t) (rand() % 20000 - 10000 + square);
+    }
+}
+
+/* Fingerprints the clip once to grow the context's buffers, then REPEATS
+ * more times, a little shorter each time, counting allocations. Returns 0 if
+ * there were none. */
+int allocationTest(const int16_t * samples, int streaming, double peakRate) {
+    PipesParams params = pipesDefaultParams();
+    params.streaming = streaming;
+    params.peakRate = peakRate;
+
+    PipesContext * context;
+    int error = pipesNewContext(&context, &params);
+    if (error != PIPES_OK) {
+        fprintf(stderr, "error! %s.\n", pipesError(error));
+        exit(1);
+    }
+
+    const PipesPrint * prints;
+    int count;
+    error = pipesFingerprint(context, samples, FRAMES, 1, RATE, &prints,
+            &count);
+
+    allocations = 0;
+    counting = 1;
+    for (int i = 0; i < REPEATS && error == PIPES_OK; i++)
+        error = pipesFingerprint(context, samples, FRAMES - i * 1000, 1, RATE,
+                &prints, &count);
+    counting = 0;
+
+    if (error != PIPES_OK) {
+        fprintf(stderr, "error! %s.\n", pipesError(error));
+        exit(1);
+    }
+
+    printf("%s, %s peaks: %d fingerprints, %ld allocations\n",
+            streaming ? "streaming" : "spectrogram",
+            peakRate > 0 ? "adaptive" : "fixed", count, allocations);
+
+    pipesFreeContext(context);
+    return allocations != 0 || count == 0;
+}
+
+int main(void) {
+    int16_t * samples = malloc(sizeof(int16_t) * FRAMES);
+    if (samples == NULL) {
+        fprintf(stderr, "error, out of memory\n");
+        exit(1);
+    }
+    makeClip(samples, FRAMES);
+
+    int result = 0;
+    for (int streaming = 0; streaming <= 1; streaming++) {
+        result |= allocationTest(samples, streaming, 0);
+        result |= allocationTest(samples, streaming, 30);
+    }
+
+    free(samples);
+    if (result)
+        printf("test failed!\n");
+    else
+        printf("test passed!\n");
+    return result;
+}
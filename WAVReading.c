@@ -37,12 +37,40 @@ uint16_t readWAVChannels(FILE * infile) {
     return result;
 }
 
+/* Reads the header of a WAV file and returns its sample rate in Hz.
+ * Leaves the file pointer at the beginning of the sample values in the file.
+ */
+uint32_t readWAVSampleRate(FILE * infile) {
+
+    uint32_t result;
+
+    /* Seek to the beginning of the sample rate integer. */
+    if (fseek(infile, 24, SEEK_SET)) {
+        fprintf(stderr, "readWAVSampleRate: error seeking file.\n");
+        exit(1);
+    }
+
+    /* Read the 4-byte sample rate integer into the result. */
+    if (fread(&result, 4, 1, infile) != 1) {
+        fprintf(stderr, "readWAVSampleRate: error reading file.\n");
+        exit(1);
+    }
+
+    /* Seek to the beginning of the data section. */
+    if (fseek(infile, 44, SEEK_SET)) {
+        fprintf(stderr, "readWAVSampleRate: error seeking file.\n");
+        exit(1);
+    }
+
+    return result;
+}
+
 /* Read a WAV header and use the number of channels to compute how many samples
  * are in one channel from start to finish. */
 int readWAVLength(FILE * infile, int channels) {
 
     int result;
-    int sampleSize;
+    int sampleSize = 0;
 
     /* Seek to the location of the sample size integer in the header. */
     if (fseek(infile, 34, SEEK_SET)) {
@@ -109,3 +137,29 @@ int getNextMValues(FILE * infile,
 }
 
 
+
+/* Read the sample values of a WAV file into memory, with the channels
+ * interleaved as they are in the file. Sets frames to the number of samples
+ * per channel that were read, which can fall short of what the header says
+ * for a truncated file. Leaves the file pointer at the end of what was read.
+ * ASSumes 2 byte samples, like getNextMValues. */
+int16_t * readWAVSamples(FILE * infile, int channels, int * frames) {
+
+    int length = readWAVLength(infile, channels);
+    size_t values = (size_t) (length > 0 ? length : 0) * channels;
+
+    int16_t * samples = malloc(sizeof(int16_t) * (values > 0 ? values : 1));
+    if (samples == NULL) {
+        fprintf(stderr, "readWAVSamples: error! Out of memory.\n");
+        exit(1);
+    }
+
+    size_t got = fread(samples, sizeof(int16_t), values, infile);
+    if (ferror(infile)) {
+        fprintf(stderr, "readWAVSamples: error reading file.\n");
+        exit(1);
+    }
+
+    *frames = got / channels;
+    return samples;
+}
@@ -1,9 +1,14 @@
 /* WAVReading.h */
 #include <stdint.h>
+#include <complex.h>
 
 uint16_t readWAVChannels(FILE * infile);
 
+uint32_t readWAVSampleRate(FILE * infile);
+
 int readWAVLength(FILE * infile, int channels);
 
+int16_t * readWAVSamples(FILE * infile, int channels, int * frames);
+
 int getNextMValues(FILE * infile,
         double complex * output, int m, int channels);